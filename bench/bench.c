@@ -0,0 +1,430 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#ifdef __GNUC__
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function" // only monotonicSeconds is used
+#endif
+#include "../src/timing.c"
+#ifdef __GNUC__
+#pragma GCC diagnostic pop
+#endif
+
+// End to end benchmark of the litho binary. Makes synthetic images (the same pixels every time) and
+// runs litho on each of them for every combination of pixels_per_vertex, frame and format, recording
+// the best wall time of a few runs, the peak resident memory and the size of the output. Results are
+// written as json, and compared with a baseline from an earlier run: anything slower, bigger or
+// hungrier than the tolerances allow is listed, and the exit status is 1.
+// Baselines only mean something on the machine that made them. Not available on windows.
+//
+//   gcc -O2 bench/bench.c -o litho-bench -lm
+//   ./litho-bench --litho ./litho -o results.json --baseline bench/baseline.json
+
+#define MAX_LIST 16
+#define MIN_TIME_CHANGE 0.02 // seconds. closer than this to the baseline is noise, whatever the tolerance
+
+typedef enum {
+    PATTERN_GRADIENT,
+    PATTERN_NOISE,
+    PATTERN_PHOTO, // noise with a 1/f spectrum, like most photos have
+    N_PATTERNS,
+} Pattern;
+static const char* const pattern_names[N_PATTERNS] = {"gradient", "noise", "photo"};
+static const char* const format_names[] = {"obj", "stl", "3mf"};
+
+typedef struct {
+    const char* litho;
+    const char* work_dir; // inputs (kept between runs, they take a while to make) and outputs
+    const char* output; // results json, NULL to skip
+    const char* baseline; // NULL to skip comparing
+    const char* extra_args; // appended to every litho command line
+    int sizes[MAX_LIST]; // megapixels
+    int n_sizes;
+    int ppvs[MAX_LIST];
+    int n_ppvs;
+    int frames[2];
+    int n_frames;
+    int formats[3]; // index into format_names
+    int n_formats;
+    int patterns[N_PATTERNS];
+    int n_patterns;
+    int repeat;
+    double time_tolerance; // fraction over the baseline that still passes
+    double rss_tolerance;
+    double bytes_tolerance;
+} BenchConfig;
+
+typedef struct {
+    char name[128];
+    double seconds;
+    long peak_rss_kb;
+    long long output_bytes;
+} BenchResult;
+
+// pixels
+
+static inline uint32_t hash3(uint32_t x, uint32_t y, uint32_t z) {
+    uint32_t h = x*0x8da6b343u ^ y*0xd8163841u ^ z*0xcb1ab31fu;
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+    h *= 0x297a2d39u;
+    h ^= h >> 15;
+    return h;
+}
+static inline float latticeValue(int x, int y, int octave) { // 0 to 1
+    return (hash3(x, y, octave) >> 8)*(1.0f/(1 << 24));
+}
+static float valueNoise(float x, float y, int octave) { // smooth noise with a feature every 1 unit
+    int x0 = (int)x, y0 = (int)y;
+    float tx = x - x0, ty = y - y0;
+    tx = tx*tx*(3 - 2*tx);
+    ty = ty*ty*(3 - 2*ty);
+    float top = latticeValue(x0, y0, octave)*(1 - tx) + latticeValue(x0 + 1, y0, octave)*tx;
+    float bottom = latticeValue(x0, y0 + 1, octave)*(1 - tx) + latticeValue(x0 + 1, y0 + 1, octave)*tx;
+    return top*(1 - ty) + bottom*ty;
+}
+
+static void patternRow(Pattern pattern, int width, int height, int y, unsigned char* row) {
+    for (int x = 0; x < width; x++) {
+        float v;
+        if (pattern == PATTERN_GRADIENT) { // diagonal ramp with a soft ripple, so no two rows are the same
+            v = (float)(x + y)/(width + height) + 0.05f*sinf(x*0.01f)*cosf(y*0.013f);
+        } else if (pattern == PATTERN_NOISE) {
+            v = (hash3(x, y, 99) >> 24)/255.0f;
+        } else { // octaves of value noise from 512 pixel features down to 2, each half as strong as the last
+            v = 0;
+            float amp = 0.5f, cell = 512;
+            for (int octave = 0; cell >= 2; octave++, amp *= 0.5f, cell *= 0.5f) {
+                v += amp*valueNoise(x/cell, y/cell, octave);
+            }
+        }
+        v = v < 0 ? 0 : v > 1 ? 1 : v;
+        row[x] = (unsigned char)(v*255 + 0.5f);
+    }
+}
+
+static void imageSize(int megapixels, int* width, int* height) { // 4:3
+    *width = (int)sqrt(megapixels*1e6*4/3);
+    *height = (int)(megapixels*1e6 / *width);
+}
+
+// makes the input as an 8 bit pgm, litho's cheapest format to read, unless it's there already
+static int makeInput(const char* path, Pattern pattern, int megapixels) {
+    int width, height;
+    imageSize(megapixels, &width, &height);
+    char header[64];
+    int header_len = snprintf(header, sizeof(header), "P5\n%d %d\n255\n", width, height);
+    struct stat st;
+    if (stat(path, &st) == 0 && st.st_size == header_len + (long long)width*height) {
+        return 1;
+    }
+    printf("making %s (%dx%d)\n", path, width, height);
+    fflush(stdout);
+    FILE* f = fopen(path, "wb");
+    if (!f) {
+        return 0;
+    }
+    fwrite(header, 1, header_len, f);
+    unsigned char* row = (unsigned char*)malloc(width);
+    for (int y = 0; y < height; y++) {
+        patternRow(pattern, width, height, y, row);
+        fwrite(row, 1, width, f);
+    }
+    free(row);
+    return fclose(f) == 0;
+}
+
+// running litho
+
+// runs argv with its output thrown away. returns 0 if it couldn't be run or didn't exit cleanly
+static int runTimed(char* argv[], double* seconds, long* peak_rss_kb) {
+    double start = monotonicSeconds();
+    pid_t pid = fork();
+    if (pid < 0) {
+        return 0;
+    }
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    int status;
+    struct rusage usage;
+    while (wait4(pid, &status, 0, &usage) < 0) {
+        if (errno != EINTR) {
+            return 0;
+        }
+    }
+    *seconds = monotonicSeconds() - start;
+#ifdef __APPLE__
+    *peak_rss_kb = usage.ru_maxrss/1024; // bytes there, kilobytes on linux
+#else
+    *peak_rss_kb = usage.ru_maxrss;
+#endif
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static int benchCase(const BenchConfig* config, const char* input, Pattern pattern, int megapixels, int ppv, int frame, int format, BenchResult* result) {
+    char output[4096], ppv_arg[16];
+    snprintf(output, sizeof(output), "%s/out.%s", config->work_dir, format_names[format]);
+    snprintf(ppv_arg, sizeof(ppv_arg), "%d", ppv);
+    char* argv[64] = {(char*)config->litho, (char*)input, "-o", output, "--format", (char*)format_names[format],
+                      "--pixels_per_vertex", ppv_arg, frame ? "--has_frame" : "--no_frame"};
+    int argc = 9;
+    char* extra = config->extra_args ? strdup(config->extra_args) : NULL;
+    for (char* arg = extra ? strtok(extra, " ") : NULL; arg && argc < 63; arg = strtok(NULL, " ")) {
+        argv[argc++] = arg;
+    }
+    argv[argc] = NULL;
+
+    int ok = 1;
+    *result = (BenchResult){.seconds = INFINITY};
+    snprintf(result->name, sizeof(result->name), "%s-%dmp-ppv%d-%s-%s", pattern_names[pattern], megapixels, ppv, frame ? "frame" : "noframe", format_names[format]);
+    for (int r = 0; r < config->repeat && ok; r++) {
+        double seconds = INFINITY;
+        long rss = 0;
+        ok = runTimed(argv, &seconds, &rss);
+        result->seconds = seconds < result->seconds ? seconds : result->seconds;
+        result->peak_rss_kb = rss > result->peak_rss_kb ? rss : result->peak_rss_kb;
+    }
+    struct stat st;
+    if (ok && stat(output, &st) == 0) {
+        result->output_bytes = st.st_size;
+    } else {
+        ok = 0;
+    }
+    unlink(output);
+    free(extra);
+    return ok;
+}
+
+// results files, one case per line so they can be read back without a json parser
+
+static void writeResults(const char* path, const BenchResult* results, int n) {
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        printf("couldn't write %s\n", path);
+        return;
+    }
+    fprintf(f, "{\"cases\": [\n");
+    for (int i = 0; i < n; i++) {
+        fprintf(f, "  {\"name\": \"%s\", \"seconds\": %.4f, \"peak_rss_kb\": %ld, \"output_bytes\": %lld}%s\n",
+                results[i].name, results[i].seconds, results[i].peak_rss_kb, results[i].output_bytes, i + 1 < n ? "," : "");
+    }
+    fprintf(f, "]}\n");
+    fclose(f);
+}
+static BenchResult* readResults(const char* path, int* n) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        return NULL;
+    }
+    int cap = 64;
+    BenchResult* results = (BenchResult*)malloc(sizeof(BenchResult)*cap);
+    *n = 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), f)) {
+        BenchResult r = {0};
+        if (sscanf(line, " {\"name\": \"%127[^\"]\", \"seconds\": %lf, \"peak_rss_kb\": %ld, \"output_bytes\": %lld",
+                   r.name, &r.seconds, &r.peak_rss_kb, &r.output_bytes) != 4) {
+            continue;
+        }
+        if (*n == cap) {
+            cap *= 2;
+            results = (BenchResult*)realloc(results, sizeof(BenchResult)*cap);
+        }
+        results[(*n)++] = r;
+    }
+    fclose(f);
+    return results;
+}
+
+static double change(double now, double before) {
+    return before > 0 ? now/before - 1 : 0;
+}
+// prints how result compares with the baseline's case of the same name. returns 1 if it's a regression
+static int compareResult(const BenchConfig* config, const BenchResult* result, const BenchResult* baseline, int n_baseline) {
+    const BenchResult* base = NULL;
+    for (int i = 0; i < n_baseline && !base; i++) {
+        base = strcmp(baseline[i].name, result->name) == 0 ? &baseline[i] : NULL;
+    }
+    if (!base) {
+        printf("    not in baseline\n");
+        return 0;
+    }
+    double dt = change(result->seconds, base->seconds);
+    double drss = change(result->peak_rss_kb, base->peak_rss_kb);
+    double dbytes = change(result->output_bytes, base->output_bytes);
+    int slow = dt > config->time_tolerance && result->seconds - base->seconds > MIN_TIME_CHANGE;
+    int hungry = drss > config->rss_tolerance;
+    int bigger = fabs(dbytes) > config->bytes_tolerance; // the output changing size at all is worth knowing about
+    printf("    vs baseline: time %+.1f%%%s, rss %+.1f%%%s, bytes %+.2f%%%s\n",
+           dt*100, slow ? " REGRESSION" : "", drss*100, hungry ? " REGRESSION" : "", dbytes*100, bigger ? " CHANGED" : "");
+    return slow || hungry || bigger;
+}
+
+// command line
+
+static int parseList(const char* s, int* out, int max) { // comma separated ints
+    int n = 0;
+    for (const char* p = s; *p && n < max; p++) {
+        out[n++] = atoi(p);
+        p = strchr(p, ',');
+        if (!p) {
+            break;
+        }
+    }
+    return n;
+}
+static int parseNames(const char* s, const char* const* names, int n_names, int* out) { // comma separated names, -1 on an unknown one
+    int n = 0;
+    char* copy = strdup(s);
+    for (char* name = strtok(copy, ","); name; name = strtok(NULL, ",")) {
+        int found = -1;
+        for (int i = 0; i < n_names; i++) {
+            found = strcmp(name, names[i]) == 0 ? i : found;
+        }
+        if (found < 0 || n == n_names) {
+            printf("unknown or repeated: %s\n", name);
+            n = -1;
+            break;
+        }
+        out[n++] = found;
+    }
+    free(copy);
+    return n;
+}
+
+static void printBenchUsage() {
+    printf("Usage: litho-bench [options]\n");
+    printf("  --litho <path>            litho binary to run (default: ./litho)\n");
+    printf("  --work <dir>              where inputs are made and kept, and outputs go (default: bench-work)\n");
+    printf("  -o <file>                 write the results as json\n");
+    printf("  --baseline <file>         compare with earlier results, exit 1 on a regression\n");
+    printf("  --sizes <mp,...>          image sizes in megapixels (default: 1)\n");
+    printf("  --ppv <n,...>             pixels_per_vertex values (default: 1,2,4)\n");
+    printf("  --frames <1,0>            with and/or without the frame (default: 1,0)\n");
+    printf("  --formats <obj,stl,3mf>   (default: all three)\n");
+    printf("  --patterns <gradient,noise,photo>  (default: all three)\n");
+    printf("  --args \"...\"              extra options for every run, like \"--threads 4\"\n");
+    printf("  --repeat <n>              runs of each case, the fastest counts (default: 3)\n");
+    printf("  --time_tolerance <f>      slowdown allowed, as a fraction (default: 0.25)\n");
+    printf("  --rss_tolerance <f>       memory growth allowed (default: 0.10)\n");
+    printf("  --bytes_tolerance <f>     output size change allowed, either way (default: 0)\n");
+    printf("The full range: --sizes 1,16,64,200\n");
+}
+
+int main(int argc, char* argv[]) {
+    BenchConfig config = {
+        .litho = "./litho", .work_dir = "bench-work", .output = NULL, .baseline = NULL, .extra_args = NULL,
+        .sizes = {1}, .n_sizes = 1, .ppvs = {1, 2, 4}, .n_ppvs = 3, .frames = {1, 0}, .n_frames = 2,
+        .formats = {0, 1, 2}, .n_formats = 3, .patterns = {PATTERN_GRADIENT, PATTERN_NOISE, PATTERN_PHOTO}, .n_patterns = N_PATTERNS,
+        .repeat = 3, .time_tolerance = 0.25, .rss_tolerance = 0.10, .bytes_tolerance = 0,
+    };
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 == argc) { // every option takes a value
+            printBenchUsage();
+            return 1;
+        }
+        const char* option = argv[i];
+        const char* value = argv[++i];
+        if (strcmp(option, "--litho") == 0) {
+            config.litho = value;
+        } else if (strcmp(option, "--work") == 0) {
+            config.work_dir = value;
+        } else if (strcmp(option, "-o") == 0) {
+            config.output = value;
+        } else if (strcmp(option, "--baseline") == 0) {
+            config.baseline = value;
+        } else if (strcmp(option, "--args") == 0) {
+            config.extra_args = value;
+        } else if (strcmp(option, "--sizes") == 0) {
+            config.n_sizes = parseList(value, config.sizes, MAX_LIST);
+        } else if (strcmp(option, "--ppv") == 0) {
+            config.n_ppvs = parseList(value, config.ppvs, MAX_LIST);
+        } else if (strcmp(option, "--frames") == 0) {
+            config.n_frames = parseList(value, config.frames, 2);
+        } else if (strcmp(option, "--formats") == 0) {
+            config.n_formats = parseNames(value, format_names, 3, config.formats);
+        } else if (strcmp(option, "--patterns") == 0) {
+            config.n_patterns = parseNames(value, pattern_names, N_PATTERNS, config.patterns);
+        } else if (strcmp(option, "--repeat") == 0) {
+            config.repeat = atoi(value);
+        } else if (strcmp(option, "--time_tolerance") == 0) {
+            config.time_tolerance = atof(value);
+        } else if (strcmp(option, "--rss_tolerance") == 0) {
+            config.rss_tolerance = atof(value);
+        } else if (strcmp(option, "--bytes_tolerance") == 0) {
+            config.bytes_tolerance = atof(value);
+        } else {
+            printBenchUsage();
+            return 1;
+        }
+    }
+    if (config.n_formats < 0 || config.n_patterns < 0 || config.repeat < 1 || access(config.litho, X_OK) != 0) {
+        printf("nothing to run, or no litho at %s\n", config.litho);
+        return 1;
+    }
+    mkdir(config.work_dir, 0777);
+
+    BenchResult* baseline = NULL;
+    int n_baseline = 0;
+    if (config.baseline && !(baseline = readResults(config.baseline, &n_baseline))) {
+        printf("couldn't read the baseline %s\n", config.baseline);
+        return 1;
+    }
+
+    int n_cases = config.n_sizes*config.n_patterns*config.n_ppvs*config.n_frames*config.n_formats;
+    BenchResult* results = (BenchResult*)calloc(n_cases > 0 ? n_cases : 1, sizeof(BenchResult));
+    int n = 0, failed = 0, regressions = 0;
+    for (int s = 0; s < config.n_sizes; s++) {
+        for (int p = 0; p < config.n_patterns; p++) {
+            Pattern pattern = (Pattern)config.patterns[p];
+            char input[4096];
+            snprintf(input, sizeof(input), "%s/%s-%dmp.pgm", config.work_dir, pattern_names[pattern], config.sizes[s]);
+            if (!makeInput(input, pattern, config.sizes[s])) {
+                printf("couldn't make %s\n", input);
+                return 1;
+            }
+            for (int v = 0; v < config.n_ppvs; v++) {
+                for (int fr = 0; fr < config.n_frames; fr++) {
+                    for (int fo = 0; fo < config.n_formats; fo++) {
+                        BenchResult* r = &results[n];
+                        if (!benchCase(&config, input, pattern, config.sizes[s], config.ppvs[v], config.frames[fr], config.formats[fo], r)) {
+                            printf("%-36s FAILED\n", r->name);
+                            failed++;
+                            continue;
+                        }
+                        printf("%-36s %9.3fs %8ld KB %12lld bytes\n", r->name, r->seconds, r->peak_rss_kb, r->output_bytes);
+                        if (baseline) {
+                            regressions += compareResult(&config, r, baseline, n_baseline);
+                        }
+                        fflush(stdout);
+                        n++;
+                    }
+                }
+            }
+        }
+    }
+    if (config.output) {
+        writeResults(config.output, results, n);
+    }
+    printf("%d cases, %d failed", n + failed, failed);
+    if (baseline) {
+        printf(", %d past the baseline's tolerances", regressions);
+    }
+    printf("\n");
+    free(results);
+    free(baseline);
+    return failed || regressions ? 1 : 0;
+}
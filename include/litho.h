@@ -0,0 +1,130 @@
+#ifndef LITHO_H
+#define LITHO_H
+
+#include <stddef.h>
+
+// liblitho: images to lithophane meshes, for use inside another program.
+// Build it from src/litho.c, which pulls in the rest of the sources as one translation unit:
+//     gcc -O2 -fPIC -fvisibility=hidden -shared src/litho.c -o liblitho.so -lm -lpthread
+//     gcc -O2 -fvisibility=hidden -c src/litho.c -o litho.o && ar rcs liblitho.a litho.o
+// There is no global state. Different images and models can be used from different threads at
+// once, and a finished model can be read and written by several threads at the same time.
+// Vertices and faces are only ever handed out in ranges, so a model never needs its whole mesh in memory.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define LITHO_API __attribute__((visibility("default")))
+#else
+#define LITHO_API
+#endif
+
+typedef enum {
+    LITHO_PIXELS_U8, // 0 to 255
+    LITHO_PIXELS_U16, // 0 to 65535, from 16 bit pngs, pgms and ppms
+    LITHO_PIXELS_F32, // 0 to 1, from pfm and hdr files. values outside that are clamped when they're read
+} LithoPixelType;
+
+typedef struct {
+    int crop_x; // region of the image to keep, in pixels. crop_width or crop_height of 0 keeps the rest of the image
+    int crop_y;
+    int crop_width;
+    int crop_height;
+    int scale; // keep one pixel per scale x scale block, averaged. 1 for full size
+} LithoLoadOptions;
+
+// how the pixels under each vertex are combined, see sampleBrightness in img.c
+typedef enum {
+    LITHO_FILTER_POINT,
+    LITHO_FILTER_BOX,
+    LITHO_FILTER_TRIANGLE,
+    LITHO_FILTER_LANCZOS,
+} LithoFilter;
+
+typedef enum {
+    LITHO_CURVE_LINEAR,
+    LITHO_CURVE_GAMMA,
+    LITHO_CURVE_LOG,
+    LITHO_CURVE_CSV,
+} LithoCurve;
+
+typedef struct {
+    int has_frame;
+    int bevel_corners;
+    int pixels_per_vertex;
+    LithoFilter filter; // how the pixels under each vertex are combined
+    float min_thickness;
+    float max_thickness;
+    float bright_scale;
+    float frame_thickness;
+    float frame_angle;
+    float frame_width;
+    float scale;
+    int flip_x;
+    int flip_y;
+    int flip_z;
+    int threads; // 0 means one per core
+    float max_error; // if > 0, the image grid is simplified to within this height error
+    int max_faces; // if > 0, the finished mesh is simplified down to this many faces
+    float simplify_error; // if > 0, the finished mesh is simplified until collapses would move it further than this
+    LithoCurve curve; // tone curve applied to brightness before it becomes a height
+    float curve_param; // gamma exponent, or log strength. 0 for the curve's default
+    float* curve_points; // LITHO_CURVE_CSV: n_curve_points (input, output) brightness pairs, sorted by input
+    int n_curve_points;
+} LithoOptions;
+
+typedef enum {
+    LITHO_FORMAT_OBJ,
+    LITHO_FORMAT_STL,
+    LITHO_FORMAT_3MF,
+} LithoFormat;
+
+LITHO_API LithoLoadOptions lithoDefaultLoadOptions(void);
+LITHO_API LithoOptions lithoDefaultOptions(void);
+// sets opts to a curve read from a csv file of "input,output" brightness pairs. curve_points is
+// allocated with malloc and belongs to the caller. returns 0 if there's no usable curve
+LITHO_API int lithoLoadCurveCsv(const char* filename, LithoOptions* opts);
+
+typedef struct LithoImage LithoImage;
+typedef struct LithoModel LithoModel;
+
+// images. all return NULL if the image can't be read
+LITHO_API LithoImage* lithoLoadImage(const char* filename, LithoLoadOptions load);
+LITHO_API LithoImage* lithoDecodeImage(const void* data, size_t size, LithoLoadOptions load); // an image file's bytes, which are copied
+LITHO_API LithoImage* lithoImageFromPixels(const void* pixels, int width, int height, int channels, LithoPixelType type); // copied, rows top to bottom
+LITHO_API void lithoImageSize(const LithoImage* img, int* width, int* height, int* channels);
+LITHO_API void lithoFreeImage(LithoImage* img);
+
+// builds the lithophane for img, and frees img (its pixels are let go of as soon as they've been read).
+// with stream set, the grid heights are worked out whenever they're read instead of being stored,
+// which keeps memory down for large images (ignored when opts simplifies the mesh).
+// returns NULL, still freeing img, if img is NULL or opts can't make a mesh of it: pixels_per_vertex
+// under 1, an image under 2*pixels_per_vertex pixels either way, scale not above 0, negative frame sizes
+// or max_faces, or a csv curve without points
+LITHO_API LithoModel* lithoMakeModel(LithoImage* img, const LithoOptions* opts, int stream);
+LITHO_API int lithoVertexCount(const LithoModel* model);
+LITHO_API int lithoFaceCount(const LithoModel* model);
+// copy vertices [start, start + count) into xyz (3 floats each), or faces into indices (3 each,
+// 0-based vertex indices), in buffers the caller owns
+LITHO_API void lithoGetVertices(const LithoModel* model, int start, int count, float* xyz);
+LITHO_API void lithoGetFaces(const LithoModel* model, int start, int count, int* indices);
+// the same for the whole mesh, in arrays the model owns. they're made on the first call (so don't
+// make that call from two threads at once) and last until lithoFreeModel
+LITHO_API const float* lithoVertices(LithoModel* model);
+LITHO_API const int* lithoFaces(LithoModel* model);
+LITHO_API void lithoFreeModel(LithoModel* model);
+
+// writers. write gets the file a piece at a time, in order, always from the calling thread. n_threads
+// formats on that many threads (0 for one per core) and gives the same output for any count.
+// lithoSaveModel returns 0 if the file can't be written
+typedef void (*LithoWriteFn)(void* user, const char* data, size_t len);
+LITHO_API void lithoWriteModel(const LithoModel* model, LithoFormat format, LithoWriteFn write, void* user, int n_threads);
+LITHO_API int lithoSaveModel(const LithoModel* model, LithoFormat format, const char* filename, int n_threads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+// Batch mode: many images converted with the same options in one process. A pool of workers, one
+// per thread, each take the next image off the list and load, build and save it by themselves, so
+// the decoding, meshing and writing of different images overlap. Each image runs on one thread
+// unless there are fewer images than threads. Workers keep their output buffer from one image to the next.
+// expects export.c and cache.c to be included first
+
+typedef struct {
+    char** paths;
+    int n;
+    int cap;
+} PathList;
+
+static void addPath(PathList* list, const char* path) {
+    if (list->n == list->cap) {
+        list->cap = list->cap ? list->cap*2 : 64;
+        list->paths = (char**)realloc(list->paths, sizeof(char*)*list->cap);
+    }
+    list->paths[list->n++] = strdup(path);
+}
+static void freePathList(PathList* list) {
+    for (int i = 0; i < list->n; i++) {
+        free(list->paths[i]);
+    }
+    free(list->paths);
+    *list = (PathList){0};
+}
+
+static int isImagePath(const char* name) { // by extension, the formats loadInputImage reads
+    static const char* exts[] = {"png", "jpg", "jpeg", "bmp", "tga", "gif", "psd", "hdr", "pic", "pgm", "ppm", "pnm", "pfm"};
+    const char* dot = strrchr(name, '.');
+    if (!dot) {
+        return 0;
+    }
+    for (size_t i = 0; i < sizeof(exts)/sizeof(exts[0]); i++) {
+        const char* a = dot + 1;
+        const char* b = exts[i];
+        while (*a && *b && tolower((unsigned char)*a) == *b) {
+            a++;
+            b++;
+        }
+        if (!*a && !*b) {
+            return 1;
+        }
+    }
+    return 0;
+}
+static int isDirectory(const char* path) {
+#ifdef _WIN32
+    DWORD attrs = GetFileAttributesA(path);
+    return attrs != INVALID_FILE_ATTRIBUTES && (attrs & FILE_ATTRIBUTE_DIRECTORY);
+#else
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+#endif
+}
+static int comparePaths(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// the images in a directory, sorted by name, or the paths listed in a text file, one per line
+// (blank lines and lines starting with # are skipped). returns 0 if source can't be read
+static int readBatchList(const char* source, PathList* list) {
+    if (isDirectory(source)) {
+        size_t dir_len = strlen(source);
+        char* path = (char*)malloc(dir_len + 1024);
+#ifdef _WIN32
+        snprintf(path, dir_len + 1024, "%s\\*", source);
+        WIN32_FIND_DATAA entry;
+        HANDLE find = FindFirstFileA(path, &entry);
+        if (find == INVALID_HANDLE_VALUE) {
+            free(path);
+            return 0;
+        }
+        do {
+            if (!(entry.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && isImagePath(entry.cFileName)) {
+                snprintf(path, dir_len + 1024, "%s\\%s", source, entry.cFileName);
+                addPath(list, path);
+            }
+        } while (FindNextFileA(find, &entry));
+        FindClose(find);
+#else
+        DIR* dir = opendir(source);
+        if (!dir) {
+            free(path);
+            return 0;
+        }
+        struct dirent* entry;
+        while ((entry = readdir(dir))) {
+            if (entry->d_name[0] != '.' && isImagePath(entry->d_name)) {
+                snprintf(path, dir_len + 1024, "%s/%s", source, entry->d_name);
+                if (!isDirectory(path)) {
+                    addPath(list, path);
+                }
+            }
+        }
+        closedir(dir);
+#endif
+        free(path);
+        qsort(list->paths, list->n, sizeof(char*), comparePaths);
+        return 1;
+    }
+    FILE* f = fopen(source, "r");
+    if (!f) {
+        return 0;
+    }
+    char line[4096];
+    while (fgets(line, sizeof(line), f)) {
+        char* start = line;
+        while (isspace((unsigned char)*start)) {
+            start++;
+        }
+        char* end = start + strlen(start);
+        while (end > start && isspace((unsigned char)end[-1])) {
+            *--end = '\0';
+        }
+        if (*start && *start != '#') {
+            addPath(list, start);
+        }
+    }
+    fclose(f);
+    return 1;
+}
+
+// where the mesh for input goes: out_dir/name.ext for an input of some/dir/name.png, or next to
+// the input when out_dir is NULL
+static char* batchOutputPath(const char* input, const char* out_dir, const char* ext) {
+    const char* name = input;
+    for (const char* p = input; *p; p++) {
+        if (*p == '/' || *p == '\\') {
+            name = p + 1;
+        }
+    }
+    const char* dot = strrchr(name, '.');
+    size_t name_len = dot && dot != name ? (size_t)(dot - name) : strlen(name);
+    const char* dir = out_dir ? out_dir : input;
+    size_t dir_len = out_dir ? strlen(out_dir) : (size_t)(name - input);
+    char* path = (char*)malloc(dir_len + name_len + strlen(ext) + 3);
+    memcpy(path, dir, dir_len);
+    size_t len = dir_len;
+    if (out_dir && dir_len > 0 && out_dir[dir_len - 1] != '/' && out_dir[dir_len - 1] != '\\') {
+        path[len++] = '/';
+    }
+    memcpy(path + len, name, name_len);
+    len += name_len;
+    path[len++] = '.';
+    strcpy(path + len, ext);
+    return path;
+}
+
+typedef struct {
+    const PathList* inputs;
+    const char* out_dir; // NULL to write each mesh next to its image
+    LithoFormat format;
+    LithoOptions opts; // threads is how many each image gets
+    LithoLoadOptions load;
+    int use_stream;
+    Cache cache;
+    int argc; // for the obj header
+    char** argv;
+    uint64_t next; // next image to take
+    uint64_t done;
+    uint64_t failed;
+} Batch;
+
+static void batchWorker(void* ctx, int worker) { // takes images until there are none left
+    Batch* batch = (Batch*)ctx;
+    (void)worker; // workers all take from the same counter, which one this is doesn't matter
+    const char* ext = batch->format == LITHO_FORMAT_STL ? "stl" : batch->format == LITHO_FORMAT_3MF ? "3mf" : "obj";
+    OutBuf out = outBufInit(flushToFile, NULL);
+    uint64_t i;
+    while ((i = atomicAdd(&batch->next, 1)) < (uint64_t)batch->inputs->n) {
+        const char* input = batch->inputs->paths[i];
+        char* output = batchOutputPath(input, batch->out_dir, ext);
+        const char* error = NULL;
+        const char* error_path = input;
+        int n_faces = 0;
+        char cache_key[65];
+        int cached = batch->cache.dir && cacheKey(input, batch->format, &batch->opts, &batch->load, cache_key);
+        int hit = cached && cacheFetch(&batch->cache, cache_key, batch->format, output);
+        if (!hit) {
+            Image img = loadInputImage(input, batch->load, NULL);
+            if (!img.img) {
+                error = "failed to load";
+            } else if (!imageFitsGrid(img, batch->opts.pixels_per_vertex)) {
+                error = "too small for --pixels_per_vertex";
+                freeImage(&img);
+            } else {
+                Lithophane litho = makeLithophane(img, batch->opts, batch->use_stream, NULL);
+                MeshSource mesh = lithophaneSource(&litho);
+                n_faces = mesh.n_faces;
+                if (batch->cache.dir) {
+                    unlinkIfShared(output);
+                }
+                if (!saveMeshBuffered(mesh, batch->format, output, batch->argc, batch->argv, batch->opts.threads, &out)) {
+                    error = "failed to write";
+                    error_path = output;
+                } else if (cached) {
+                    cacheStore(&batch->cache, cache_key, batch->format, output);
+                }
+                freeLithophane(&litho);
+            }
+        }
+        if (error) {
+            atomicAdd(&batch->failed, 1);
+        }
+        uint64_t done = atomicAdd(&batch->done, 1) + 1;
+        if (error) {
+            printf("[%llu/%d] %s: %s\n", (unsigned long long)done, batch->inputs->n, error, error_path);
+        } else if (hit) {
+            printf("[%llu/%d] %s -> %s (cached)\n", (unsigned long long)done, batch->inputs->n, input, output);
+        } else {
+            printf("[%llu/%d] %s -> %s (%d faces)\n", (unsigned long long)done, batch->inputs->n, input, output, n_faces);
+        }
+        fflush(stdout);
+        free(output);
+    }
+    free(out.buf);
+}
+
+// converts every image in inputs, returns how many failed
+static int runBatch(const PathList* inputs, const char* out_dir, LithoFormat format, LithoOptions opts, LithoLoadOptions load, int use_stream, Cache cache, int argc, char* argv[]) {
+    if (out_dir && !isDirectory(out_dir)) {
+#ifdef _WIN32
+        _mkdir(out_dir);
+#else
+        mkdir(out_dir, 0777);
+#endif
+    }
+    int n_threads = resolveThreads(opts.threads);
+    int n_workers = n_threads < inputs->n ? n_threads : inputs->n;
+    n_workers = n_workers > 0 ? n_workers : 1;
+    opts.threads = n_threads/n_workers; // leftover threads go to the images when there are fewer of them
+    Batch batch = {
+        .inputs = inputs, .out_dir = out_dir, .format = format, .opts = opts, .load = load,
+        .use_stream = use_stream, .cache = cache, .argc = argc, .argv = argv,
+    };
+    parallelFor(n_workers, n_workers, batchWorker, &batch);
+    return batch.failed;
+}
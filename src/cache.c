@@ -0,0 +1,361 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+#endif
+
+// --cache: finished meshes kept on disk, so converting the same image with the same options again
+// is a file copy. Entries are named by a sha-256 of the input file's bytes, every option that
+// changes the mesh, and the output format. A hit is handed out as a reflink where the filesystem
+// can share blocks, a hardlink otherwise (a copy across filesystems). Entries and outputs only
+// ever appear by rename, so parallel litho processes sharing a cache never see half a file.
+// Hits bump an entry's modification time, and when the cache grows past its size the least
+// recently used entries are deleted.
+// expects export.c to be included first
+
+#define CACHE_VERSION 1 // bump when the same options would give a different mesh
+#define CACHE_STALE_TMP 3600 // seconds before a temporary file left by a killed process is removed
+
+typedef struct {
+    const char* dir; // NULL for no cache
+    uint64_t max_bytes;
+} Cache;
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t total;
+    unsigned char block[64];
+    size_t block_len;
+} Sha256;
+
+static const uint32_t sha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t rotr32(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+static void sha256Block(Sha256* h, const unsigned char* p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[i*4] << 24 | (uint32_t)p[i*4 + 1] << 16 | (uint32_t)p[i*4 + 2] << 8 | p[i*4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = h->state[0], b = h->state[1], c = h->state[2], d = h->state[3];
+    uint32_t e = h->state[4], f = h->state[5], g = h->state[6], k = h->state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = k + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) + sha256K[i] + w[i];
+        uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        k = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    h->state[0] += a;
+    h->state[1] += b;
+    h->state[2] += c;
+    h->state[3] += d;
+    h->state[4] += e;
+    h->state[5] += f;
+    h->state[6] += g;
+    h->state[7] += k;
+}
+
+static Sha256 sha256Init() {
+    return (Sha256){.state = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19}};
+}
+static void sha256Update(Sha256* h, const void* data, size_t len) {
+    const unsigned char* p = (const unsigned char*)data;
+    h->total += len;
+    if (h->block_len > 0) {
+        size_t n = 64 - h->block_len < len ? 64 - h->block_len : len;
+        memcpy(h->block + h->block_len, p, n);
+        h->block_len += n;
+        p += n;
+        len -= n;
+        if (h->block_len < 64) {
+            return;
+        }
+        sha256Block(h, h->block);
+        h->block_len = 0;
+    }
+    for (; len >= 64; p += 64, len -= 64) {
+        sha256Block(h, p);
+    }
+    memcpy(h->block, p, len);
+    h->block_len = len;
+}
+static void sha256Hex(Sha256* h, char hex[65]) {
+    uint64_t bits = h->total*8;
+    unsigned char pad[72] = {0x80};
+    size_t pad_len = (h->block_len < 56 ? 56 : 120) - h->block_len;
+    for (int i = 0; i < 8; i++) {
+        pad[pad_len + i] = (unsigned char)(bits >> (56 - i*8));
+    }
+    sha256Update(h, pad, pad_len + 8);
+    for (int i = 0; i < 32; i++) {
+        snprintf(hex + i*2, 3, "%02x", (unsigned)(h->state[i/4] >> (24 - (i%4)*8)) & 0xff);
+    }
+}
+
+#define HASH_FIELD(h, field) sha256Update(h, &(field), sizeof(field))
+
+// the cache entry name for converting input with these options. 0 if input can't be read
+static int cacheKey(const char* input, LithoFormat format, const LithoOptions* opts, const LithoLoadOptions* load, char key[65]) {
+    FileData file = readFileData(input);
+    if (!file.data) {
+        return 0;
+    }
+    Sha256 h = sha256Init();
+    int version = CACHE_VERSION;
+    uint64_t size = file.size;
+    HASH_FIELD(&h, version);
+    HASH_FIELD(&h, size);
+    sha256Update(&h, file.data, file.size);
+    freeFileData(&file);
+    // field by field, the structs have padding and a pointer. threads is left out, it doesn't change the mesh
+    HASH_FIELD(&h, format);
+    HASH_FIELD(&h, load->crop_x);
+    HASH_FIELD(&h, load->crop_y);
+    HASH_FIELD(&h, load->crop_width);
+    HASH_FIELD(&h, load->crop_height);
+    HASH_FIELD(&h, load->scale);
+    HASH_FIELD(&h, opts->has_frame);
+    HASH_FIELD(&h, opts->bevel_corners);
+    HASH_FIELD(&h, opts->pixels_per_vertex);
+    HASH_FIELD(&h, opts->filter);
+    HASH_FIELD(&h, opts->min_thickness);
+    HASH_FIELD(&h, opts->max_thickness);
+    HASH_FIELD(&h, opts->bright_scale);
+    HASH_FIELD(&h, opts->frame_thickness);
+    HASH_FIELD(&h, opts->frame_angle);
+    HASH_FIELD(&h, opts->frame_width);
+    HASH_FIELD(&h, opts->scale);
+    HASH_FIELD(&h, opts->flip_x);
+    HASH_FIELD(&h, opts->flip_y);
+    HASH_FIELD(&h, opts->flip_z);
+    HASH_FIELD(&h, opts->max_error);
+    HASH_FIELD(&h, opts->max_faces);
+    HASH_FIELD(&h, opts->simplify_error);
+    HASH_FIELD(&h, opts->curve);
+    HASH_FIELD(&h, opts->curve_param);
+    HASH_FIELD(&h, opts->n_curve_points);
+    if (opts->n_curve_points > 0) {
+        sha256Update(&h, opts->curve_points, sizeof(float)*2*opts->n_curve_points);
+    }
+    sha256Hex(&h, key);
+    return 1;
+}
+
+#ifndef _WIN32
+
+static uint64_t cacheTmpCount = 0; // keeps the temporary names of one process's threads apart
+
+static char* cachePath(const Cache* cache, const char* key, LithoFormat format) {
+    const char* ext = format == LITHO_FORMAT_STL ? "stl" : format == LITHO_FORMAT_3MF ? "3mf" : "obj";
+    size_t len = strlen(cache->dir) + strlen(key) + 8;
+    char* path = (char*)malloc(len);
+    snprintf(path, len, "%s/%s.%s", cache->dir, key, ext);
+    return path;
+}
+static char* tmpPathNear(const char* path) { // a new name in the same directory, so it can be renamed over path
+    size_t len = strlen(path) + 64;
+    char* tmp = (char*)malloc(len);
+    const char* slash = strrchr(path, '/');
+    int dir_len = slash ? (int)(slash - path) + 1 : 0;
+    snprintf(tmp, len, "%.*s.litho-tmp-%ld-%llu", dir_len, path, (long)getpid(), (unsigned long long)atomicAdd(&cacheTmpCount, 1));
+    return tmp;
+}
+
+// makes dst a copy of src: shared blocks if the filesystem can, the same file if it has to, bytes if it must
+static int cloneFile(const char* src, const char* dst) {
+    int in = open(src, O_RDONLY);
+    if (in < 0) {
+        return 0;
+    }
+    int out = open(dst, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (out < 0) {
+        close(in);
+        return 0;
+    }
+#ifdef FICLONE
+    if (ioctl(out, FICLONE, in) == 0) {
+        close(in);
+        return close(out) == 0;
+    }
+#endif
+    close(out);
+    unlink(dst);
+    if (link(src, dst) == 0) {
+        close(in);
+        return 1;
+    }
+    out = open(dst, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    int ok = out >= 0;
+    char buf[1 << 16];
+    ssize_t n;
+    while (ok && (n = read(in, buf, sizeof(buf))) != 0) {
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        ok = n > 0 && write(out, buf, n) == n;
+    }
+    close(in);
+    if (out >= 0) {
+        ok = close(out) == 0 && ok;
+    }
+    if (!ok) {
+        unlink(dst);
+    }
+    return ok;
+}
+static int cloneAndRename(const char* src, const char* dst) {
+    char* tmp = tmpPathNear(dst);
+    int ok = cloneFile(src, tmp) && rename(tmp, dst) == 0;
+    unlink(tmp); // normally gone already, but renaming onto another link of the same file leaves it
+    free(tmp);
+    return ok;
+}
+
+// puts the cached mesh for key at output. 0 on a miss
+static int cacheFetch(const Cache* cache, const char* key, LithoFormat format, const char* output) {
+    char* entry = cachePath(cache, key, format);
+    int hit = cloneAndRename(entry, output);
+    if (hit) {
+        utimes(entry, NULL); // most recently used
+    }
+    free(entry);
+    return hit;
+}
+
+typedef struct {
+    char* path;
+    time_t used;
+    uint64_t size;
+} CacheEntry;
+
+static int compareEntries(const void* a, const void* b) { // least recently used first
+    const CacheEntry* x = (const CacheEntry*)a;
+    const CacheEntry* y = (const CacheEntry*)b;
+    return x->used < y->used ? -1 : x->used > y->used;
+}
+
+static int isCacheEntryName(const char* name) { // <64 hex digit key>.<obj|stl|3mf>, as cachePath makes them
+    for (int i = 0; i < 64; i++) {
+        if (!((name[i] >= '0' && name[i] <= '9') || (name[i] >= 'a' && name[i] <= 'f'))) {
+            return 0;
+        }
+    }
+    return strcmp(name + 64, ".obj") == 0 || strcmp(name + 64, ".stl") == 0 || strcmp(name + 64, ".3mf") == 0;
+}
+
+// deletes least recently used entries until the cache fits in max_bytes. only files named like an
+// entry or a temporary file are counted or touched, anything else in the directory is left alone. other processes can be
+// fetching or trimming at the same time, an entry deleted under them is just a miss
+static void cacheTrim(const Cache* cache) {
+    DIR* dir = opendir(cache->dir);
+    if (!dir) {
+        return;
+    }
+    CacheEntry* entries = NULL;
+    int n = 0, cap = 0;
+    uint64_t total = 0;
+    time_t now = time(NULL);
+    size_t dir_len = strlen(cache->dir);
+    struct dirent* d;
+    while ((d = readdir(dir))) {
+        int tmp = strncmp(d->d_name, ".litho-tmp-", 11) == 0;
+        if (!tmp && !isCacheEntryName(d->d_name)) {
+            continue;
+        }
+        char* path = (char*)malloc(dir_len + strlen(d->d_name) + 2);
+        sprintf(path, "%s/%s", cache->dir, d->d_name);
+        struct stat st;
+        if (lstat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            free(path);
+            continue;
+        }
+        if (tmp) { // only touched if a killed process left it behind
+            if (now - st.st_mtime > CACHE_STALE_TMP) {
+                unlink(path);
+            }
+            free(path);
+            continue;
+        }
+        if (n == cap) {
+            cap = cap ? cap*2 : 256;
+            entries = (CacheEntry*)realloc(entries, sizeof(CacheEntry)*cap);
+        }
+        entries[n++] = (CacheEntry){.path = path, .used = st.st_mtime, .size = (uint64_t)st.st_size};
+        total += st.st_size;
+    }
+    closedir(dir);
+    qsort(entries, n, sizeof(CacheEntry), compareEntries);
+    for (int i = 0; i < n; i++) {
+        if (total > cache->max_bytes && unlink(entries[i].path) == 0) {
+            total -= entries[i].size;
+        }
+        free(entries[i].path);
+    }
+    free(entries);
+}
+
+// with --cache on, an output may be a hardlink to an entry from an earlier hit. call this before writing
+// it, so the new mesh replaces the link instead of being written through it into the entry. other
+// links a user made to the output are left alone when --cache is off, since it's never called then
+static void unlinkIfShared(const char* output) {
+    struct stat st;
+    if (lstat(output, &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink > 1) {
+        unlink(output);
+    }
+}
+
+// adds the mesh just written to output to the cache under key. only call it once output is
+// known to be complete, after saveMesh returned 1, or a cut off mesh would be handed out as a hit
+static void cacheStore(const Cache* cache, const char* key, LithoFormat format, const char* output) {
+    mkdir(cache->dir, 0777);
+    char* entry = cachePath(cache, key, format);
+    cloneAndRename(output, entry);
+    free(entry);
+    cacheTrim(cache);
+}
+
+#else
+
+static int cacheFetch(const Cache* cache, const char* key, LithoFormat format, const char* output) { // no reflinks or atomic replacing renames, always a miss
+    return 0;
+}
+static void unlinkIfShared(const char* output) {
+}
+static void cacheStore(const Cache* cache, const char* key, LithoFormat format, const char* output) {
+}
+
+#endif
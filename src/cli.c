@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+// Command line options, parsed into Settings. Shared by the normal command line, --batch, and the
+// requests --serve takes, which use the same options.
+// expects export.c and cache.c to be included first
+
+#define MAX_SWEEPS 8
+
+typedef struct {
+    const char* output_file; // NULL for the default name
+    LithoFormat format;
+    int use_stream;
+    int queue; // --serve: most requests waiting for a worker before new ones are turned away
+    Cache cache; // --cache, with no dir when there's no cache
+    const char* sweeps[MAX_SWEEPS]; // --sweep key=v1,v2,... arguments, see sweep.c
+    int n_sweeps;
+    TimingsFormat timings;
+    LithoOptions opts;
+    LithoLoadOptions load;
+} Settings;
+
+static Settings defaultSettings() {
+    return (Settings){.output_file = NULL, .format = LITHO_FORMAT_OBJ, .use_stream = 0, .queue = 16, .cache = {.dir = NULL, .max_bytes = (uint64_t)1024 << 20}, .timings = TIMINGS_OFF, .opts = lithoDefaultOptions(), .load = lithoDefaultLoadOptions()};
+}
+
+// Helper function to get option value, either from next argument or after '='
+static const char* get_option_value(const char* arg, int* should_increment_i) {
+    char* equals_pos = strchr(arg, '=');
+    if (equals_pos) {
+        *should_increment_i = 0;
+        return equals_pos + 1;
+    }
+    *should_increment_i = 1;
+    return NULL;
+}
+
+// parses the options in argv[first] onwards into s. on a bad option, returns 0 with a message in error
+static int parseOptions(int argc, char* argv[], int first, Settings* s, char* error, size_t error_size) {
+    const float* inherited_curve = s->opts.curve_points; // belongs to whoever passed s in, never freed here
+    for (int i = first; i < argc; i++) {
+        int should_increment_i = 0;
+        const char* value = get_option_value(argv[i], &should_increment_i);
+        
+        if (strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--output") == 0) {
+            if (i + 1 < argc) {
+                s->output_file = argv[++i];
+            }
+        } else if (strncmp(argv[i], "--format", 8) == 0) {
+            if (value || (i + 1 < argc)) {
+                const char* fmt = value ? value : argv[++i];
+                if (strcmp(fmt, "obj") == 0) {
+                    s->format = LITHO_FORMAT_OBJ;
+                } else if (strcmp(fmt, "stl") == 0) {
+                    s->format = LITHO_FORMAT_STL;
+                } else if (strcmp(fmt, "3mf") == 0) {
+                    s->format = LITHO_FORMAT_3MF;
+                } else {
+                    snprintf(error, error_size, "Unknown format: %s", fmt);
+                    return 0;
+                }
+            }
+        } else if (strncmp(argv[i], "--curve_param", 13) == 0) {
+            if (value || (i + 1 < argc)) {
+                s->opts.curve_param = atof(value ? value : argv[++i]);
+            }
+        } else if (strncmp(argv[i], "--curve", 7) == 0) {
+            if (value || (i + 1 < argc)) {
+                const char* curve = value ? value : argv[++i];
+                if (strcmp(curve, "linear") == 0) {
+                    s->opts.curve = LITHO_CURVE_LINEAR;
+                } else if (strcmp(curve, "gamma") == 0) {
+                    s->opts.curve = LITHO_CURVE_GAMMA;
+                } else if (strcmp(curve, "log") == 0) {
+                    s->opts.curve = LITHO_CURVE_LOG;
+                } else {
+                    float* previous = s->opts.curve_points;
+                    if (!lithoLoadCurveCsv(curve, &s->opts)) {
+                        snprintf(error, error_size, "Could not read a curve from '%s'", curve);
+                        return 0;
+                    }
+                    if (previous != inherited_curve) { // an earlier --curve in these same options
+                        free(previous);
+                    }
+                }
+            }
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            s->use_stream = 1;
+        } else if (strcmp(argv[i], "--has_frame") == 0) {
+            s->opts.has_frame = 1;
+        } else if (strcmp(argv[i], "--no_frame") == 0) {
+            s->opts.has_frame = 0;
+        } else if (strcmp(argv[i], "--bevel_corners") == 0) {
+            s->opts.bevel_corners = 1;
+        } else if (strncmp(argv[i], "--pixels_per_vertex", 18) == 0) {
+            if (value || (i + 1 < argc)) {
+                s->opts.pixels_per_vertex = atoi(value ? value : argv[++i]);
+            }
+        } else if (strncmp(argv[i], "--filter", 8) == 0) {
+            if (value || (i + 1 < argc)) {
+                const char* filter = value ? value : argv[++i];
+                if (strcmp(filter, "point") == 0) {
+                    s->opts.filter = LITHO_FILTER_POINT;
+                } else if (strcmp(filter, "box") == 0) {
+                    s->opts.filter = LITHO_FILTER_BOX;
+                } else if (strcmp(filter, "triangle") == 0) {
+                    s->opts.filter = LITHO_FILTER_TRIANGLE;
+                } else if (strcmp(filter, "lanczos") == 0) {
+                    s->opts.filter = LITHO_FILTER_LANCZOS;
+                } else {
+                    snprintf(error, error_size, "Unknown filter: %s", filter);
+                    return 0;
+                }
+            }
+        } else if (strncmp(argv[i], "--min_thickness", 14) == 0) {
+            if (value || (i + 1 < argc)) {
+                s->opts.min_thickness = atof(value ? value : argv[++i]);
+            }
+        } else if (strncmp(argv[i], "--max_thickness", 14) == 0) {
+            if (value || (i + 1 < argc)) {
+                s->opts.max_thickness = atof(value ? value : argv[++i]);
+            }
+        } else if (strncmp(argv[i], "--bright_scale", 13) == 0) {
+            if (value || (i + 1 < argc)) {
+                s->opts.bright_scale = atof(value ? value : argv[++i]);
+            }
+        } else if (strncmp(argv[i], "--frame_thickness", 16) == 0) {
+            if (value || (i + 1 < argc)) {
+                s->opts.frame_thickness = atof(value ? value : argv[++i]);
+            }
+        } else if (strncmp(argv[i], "--frame_angle", 12) == 0) {
+            if (value || (i + 1 < argc)) {
+                s->opts.frame_angle = atof(value ? value : argv[++i]);
+            }
+        } else if (strncmp(argv[i], "--frame_width", 12) == 0) {
+            if (value || (i + 1 < argc)) {
+                s->opts.frame_width = atof(value ? value : argv[++i]);
+            }
+        } else if (strncmp(argv[i], "--scale", 7) == 0) {
+            if (value || (i + 1 < argc)) {
+                s->opts.scale = atof(value ? value : argv[++i]);
+            }
+        } else if (strncmp(argv[i], "--max_error", 11) == 0) {
+            if (value || (i + 1 < argc)) {
+                s->opts.max_error = atof(value ? value : argv[++i]);
+            }
+        } else if (strncmp(argv[i], "--max_faces", 11) == 0) {
+            if (value || (i + 1 < argc)) {
+                s->opts.max_faces = atoi(value ? value : argv[++i]);
+            }
+        } else if (strncmp(argv[i], "--simplify_error", 16) == 0) {
+            if (value || (i + 1 < argc)) {
+                s->opts.simplify_error = atof(value ? value : argv[++i]);
+            }
+        } else if (strncmp(argv[i], "--crop", 6) == 0) {
+            if (value || (i + 1 < argc)) {
+                const char* crop = value ? value : argv[++i];
+                if (sscanf(crop, "%d,%d,%d,%d", &s->load.crop_x, &s->load.crop_y, &s->load.crop_width, &s->load.crop_height) != 4) {
+                    snprintf(error, error_size, "Invalid crop: %s (expected x,y,width,height)", crop);
+                    return 0;
+                }
+            }
+        } else if (strncmp(argv[i], "--decode_scale", 14) == 0) {
+            if (value || (i + 1 < argc)) {
+                s->load.scale = atoi(value ? value : argv[++i]);
+            }
+        } else if (strncmp(argv[i], "--queue", 7) == 0) {
+            if (value || (i + 1 < argc)) {
+                s->queue = atoi(value ? value : argv[++i]);
+            }
+        } else if (strncmp(argv[i], "--cache_size", 12) == 0) {
+            if (value || (i + 1 < argc)) {
+                s->cache.max_bytes = (uint64_t)(atof(value ? value : argv[++i])*(1 << 20));
+            }
+        } else if (strncmp(argv[i], "--cache", 7) == 0) {
+            if (value || (i + 1 < argc)) {
+                s->cache.dir = value ? value : argv[++i];
+            }
+        } else if (strncmp(argv[i], "--sweep", 7) == 0) {
+            if (value || (i + 1 < argc)) {
+                const char* sweep = value ? value : argv[++i];
+                if (!strchr(sweep, '=') || s->n_sweeps == MAX_SWEEPS) {
+                    snprintf(error, error_size, "Invalid sweep: %s (expected key=v1,v2,..., at most %d of them)", sweep, MAX_SWEEPS);
+                    return 0;
+                }
+                s->sweeps[s->n_sweeps++] = sweep;
+            }
+        } else if (strncmp(argv[i], "--timings", 9) == 0) {
+            if (value || (i + 1 < argc)) {
+                const char* format = value ? value : argv[++i];
+                if (strcmp(format, "table") == 0) {
+                    s->timings = TIMINGS_TABLE;
+                } else if (strcmp(format, "json") == 0) {
+                    s->timings = TIMINGS_JSON;
+                } else {
+                    snprintf(error, error_size, "Unknown timings format: %s", format);
+                    return 0;
+                }
+            }
+        } else if (strncmp(argv[i], "--threads", 9) == 0) {
+            if (value || (i + 1 < argc)) {
+                s->opts.threads = atoi(value ? value : argv[++i]);
+            }
+        } else if (strcmp(argv[i], "--flip_x") == 0) {
+            s->opts.flip_x = 1;
+        } else if (strcmp(argv[i], "--flip_y") == 0) {
+            s->opts.flip_y = 1;
+        } else if (strcmp(argv[i], "--flip_z") == 0) {
+            s->opts.flip_z = 1;
+        } else {
+            snprintf(error, error_size, "Unknown option: %s", argv[i]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// catches option values that would crash or divide by zero later, which parseOptions lets through.
+// returns 0 with a message in error
+static int checkSettings(const Settings* s, char* error, size_t error_size) {
+    const char* problem = lithoOptionsError(&s->opts);
+    if (problem) {
+        snprintf(error, error_size, "%s", problem);
+    } else if (s->load.scale < 1) {
+        snprintf(error, error_size, "--decode_scale has to be at least 1");
+    } else if (s->load.crop_x < 0 || s->load.crop_y < 0 || s->load.crop_width < 0 || s->load.crop_height < 0) {
+        snprintf(error, error_size, "--crop values can't be negative");
+    } else {
+        return 1;
+    }
+    return 0;
+}
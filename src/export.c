@@ -0,0 +1,272 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "geometry.c"
+#include "simplify.c"
+#include "fmt.c"
+#include "zip.c"
+
+// Mesh writers. They pull vertices and faces from a MeshSource a band at a time, so they work the
+// same on a finished Obj and on a LithoMesh that never holds the whole grid.
+// With more than one thread, the bands are formatted into separate buffers on worker threads and
+// then written out in order, so the output is the same for any thread count.
+
+#define MESH_BAND 16384 // vertices or faces fetched from the source at a time
+#define BANDS_PER_THREAD 4 // how many bands each thread formats before they're written out
+
+typedef void (*BandFn)(MeshSource mesh, int start, int count, OutBuf* ob);
+
+typedef struct {
+    MeshSource mesh;
+    BandFn fn;
+    int start; // first item of the round
+    int n_items;
+    OutBuf* bufs;
+} BandRound;
+
+static void formatBand(void* ctx, int task) {
+    BandRound* round = (BandRound*)ctx;
+    int start = round->start + task*MESH_BAND;
+    if (start < round->n_items) {
+        int count = round->n_items - start < MESH_BAND ? round->n_items - start : MESH_BAND;
+        round->fn(round->mesh, start, count, &round->bufs[task]);
+    }
+}
+
+// runs fn over [0, n_items) one band at a time and writes the results to ob in order
+static void writeBands(MeshSource mesh, int n_items, BandFn fn, OutBuf* ob, int n_threads) {
+    if (n_threads <= 1) {
+        for (int start = 0; start < n_items; start += MESH_BAND) {
+            fn(mesh, start, n_items - start < MESH_BAND ? n_items - start : MESH_BAND, ob);
+        }
+        return;
+    }
+    int per_round = n_threads*BANDS_PER_THREAD;
+    OutBuf* bufs = (OutBuf*)malloc(sizeof(OutBuf)*per_round);
+    for (int i = 0; i < per_round; i++) {
+        bufs[i] = outBufInMemory(MESH_BAND*64);
+    }
+    BandRound round = {.mesh = mesh, .fn = fn, .n_items = n_items, .bufs = bufs};
+    for (round.start = 0; round.start < n_items; round.start += per_round*MESH_BAND) {
+        parallelFor(per_round, n_threads, formatBand, &round);
+        for (int i = 0; i < per_round; i++) {
+            putBytes(ob, bufs[i].buf, bufs[i].len);
+            bufs[i].len = 0;
+        }
+    }
+    for (int i = 0; i < per_round; i++) {
+        outBufFree(&bufs[i]);
+    }
+    free(bufs);
+}
+
+static void objVertsBand(MeshSource mesh, int start, int count, OutBuf* ob) {
+    Pos* verts = (Pos*)malloc(sizeof(Pos)*count);
+    mesh.getVerts(mesh.ctx, start, count, verts);
+    for (int i = 0; i < count; i++) {
+        putBytes(ob, "v ", 2);
+        putFloat(ob, verts[i].x);
+        putChar(ob, ' ');
+        putFloat(ob, verts[i].y);
+        putChar(ob, ' ');
+        putFloat(ob, verts[i].z);
+        putChar(ob, '\n');
+    }
+    free(verts);
+}
+static void objFacesBand(MeshSource mesh, int start, int count, OutBuf* ob) {
+    Face* faces = (Face*)malloc(sizeof(Face)*count);
+    mesh.getFaces(mesh.ctx, start, count, faces);
+    for (int i = 0; i < count; i++) {
+        putBytes(ob, "f ", 2);
+        putInt(ob, faces[i].v1);
+        putChar(ob, ' ');
+        putInt(ob, faces[i].v2);
+        putChar(ob, ' ');
+        putInt(ob, faces[i].v3);
+        putChar(ob, '\n');
+    }
+    free(faces);
+}
+
+static void writeObj(MeshSource mesh, OutBuf* ob, int argc, char* argv[], int n_threads) {
+    putStr(ob, "# Lithophane obj file made using https://github.com/ekhadley/litho\n");
+    putStr(ob, "# Generated with command:");
+    for (int i = 0; i < argc; i++) {
+        putChar(ob, ' ');
+        putStr(ob, argv[i]);
+    }
+    putStr(ob, "\n");
+    putStr(ob, "o litho\n");
+    writeBands(mesh, mesh.n_verts, objVertsBand, ob, n_threads);
+    putStr(ob, "g faces\n");
+    writeBands(mesh, mesh.n_faces, objFacesBand, ob, n_threads);
+}
+
+static void putU32LE(unsigned char* p, uint32_t v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+static void putF32LE(unsigned char* p, float f) {
+    uint32_t v;
+    memcpy(&v, &f, sizeof(v));
+    putU32LE(p, v);
+}
+
+static void stlFacesBand(MeshSource mesh, int start, int count, OutBuf* ob) {
+    Face* faces = (Face*)malloc(sizeof(Face)*count);
+    mesh.getFaces(mesh.ctx, start, count, faces);
+    for (int i = 0; i < count; i++) {
+        Pos a, b, c;
+        mesh.getVerts(mesh.ctx, faces[i].v1 - 1, 1, &a); // face indices are 1-based, like in the obj file
+        mesh.getVerts(mesh.ctx, faces[i].v2 - 1, 1, &b);
+        mesh.getVerts(mesh.ctx, faces[i].v3 - 1, 1, &c);
+        float ux = b.x - a.x, uy = b.y - a.y, uz = b.z - a.z;
+        float vx = c.x - a.x, vy = c.y - a.y, vz = c.z - a.z;
+        float nx = uy*vz - uz*vy;
+        float ny = uz*vx - ux*vz;
+        float nz = ux*vy - uy*vx;
+        float len = sqrtf(nx*nx + ny*ny + nz*nz);
+        if (len > 0) {
+            nx /= len;
+            ny /= len;
+            nz /= len;
+        }
+        unsigned char* t = (unsigned char*)outBufReserve(ob, 50);
+        putF32LE(t, nx);      putF32LE(t + 4, ny);  putF32LE(t + 8, nz);
+        putF32LE(t + 12, a.x); putF32LE(t + 16, a.y); putF32LE(t + 20, a.z);
+        putF32LE(t + 24, b.x); putF32LE(t + 28, b.y); putF32LE(t + 32, b.z);
+        putF32LE(t + 36, c.x); putF32LE(t + 40, c.y); putF32LE(t + 44, c.z);
+        t[48] = 0; // attribute byte count
+        t[49] = 0;
+        ob->len += 50;
+    }
+    free(faces);
+}
+
+static void writeStl(MeshSource mesh, OutBuf* ob, int n_threads) { // binary stl: 80 byte header, triangle count, then 50 bytes per triangle
+    unsigned char header[84] = {0};
+    snprintf((char*)header, 80, "Lithophane stl file made using https://github.com/ekhadley/litho");
+    putU32LE(header + 80, mesh.n_faces);
+    putBytes(ob, header, sizeof(header));
+    writeBands(mesh, mesh.n_faces, stlFacesBand, ob, n_threads);
+}
+
+static const char* contentTypes3mf =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+    "<Types xmlns=\"http://schemas.openxmlformats.org/package/2006/content-types\">"
+    "<Default Extension=\"rels\" ContentType=\"application/vnd.openxmlformats-package.relationships+xml\"/>"
+    "<Default Extension=\"model\" ContentType=\"application/vnd.ms-package.3dmanufacturing-3dmodel+xml\"/>"
+    "</Types>\n";
+static const char* rels3mf =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+    "<Relationships xmlns=\"http://schemas.openxmlformats.org/package/2006/relationships\">"
+    "<Relationship Target=\"/3D/3dmodel.model\" Id=\"rel0\" Type=\"http://schemas.microsoft.com/3dmanufacturing/2013/01/3dmodel\"/>"
+    "</Relationships>\n";
+
+static void flushToZip(void* ctx, const char* data, size_t len) {
+    zipWrite((ZipWriter*)ctx, data, len);
+}
+
+static void modelVertsBand(MeshSource mesh, int start, int count, OutBuf* ob) {
+    Pos* verts = (Pos*)malloc(sizeof(Pos)*count);
+    mesh.getVerts(mesh.ctx, start, count, verts);
+    for (int i = 0; i < count; i++) {
+        putBytes(ob, "<vertex x=\"", 11);
+        putFloat(ob, verts[i].x);
+        putBytes(ob, "\" y=\"", 5);
+        putFloat(ob, verts[i].y);
+        putBytes(ob, "\" z=\"", 5);
+        putFloat(ob, verts[i].z);
+        putBytes(ob, "\"/>\n", 4);
+    }
+    free(verts);
+}
+static void modelFacesBand(MeshSource mesh, int start, int count, OutBuf* ob) {
+    Face* faces = (Face*)malloc(sizeof(Face)*count);
+    mesh.getFaces(mesh.ctx, start, count, faces);
+    for (int i = 0; i < count; i++) { // 3mf vertex indices are 0-based
+        putBytes(ob, "<triangle v1=\"", 14);
+        putInt(ob, faces[i].v1 - 1);
+        putBytes(ob, "\" v2=\"", 6);
+        putInt(ob, faces[i].v2 - 1);
+        putBytes(ob, "\" v3=\"", 6);
+        putInt(ob, faces[i].v3 - 1);
+        putBytes(ob, "\"/>\n", 4);
+    }
+    free(faces);
+}
+
+// the model xml is compressed in chunks as it's written, it's never all in memory at once.
+// only the xml formatting is split over threads, the compression runs on the calling thread.
+static void write3mf(MeshSource mesh, OutBuf* ob, int n_threads) {
+    ZipWriter zw;
+    if (!zipOpen(&zw, ob)) {
+        return;
+    }
+    zipBeginEntry(&zw, "[Content_Types].xml", 0);
+    zipWrite(&zw, contentTypes3mf, strlen(contentTypes3mf));
+    zipEndEntry(&zw);
+    zipBeginEntry(&zw, "_rels/.rels", 0);
+    zipWrite(&zw, rels3mf, strlen(rels3mf));
+    zipEndEntry(&zw);
+
+    // each vertex or triangle line is well under 128 bytes, so this says if the xml could pass 4GB
+    int zip64 = ((uint64_t)mesh.n_verts + (uint64_t)mesh.n_faces)*128 >= 0xffffffffu;
+    zipBeginEntry(&zw, "3D/3dmodel.model", zip64);
+    OutBuf xml = outBufInit(flushToZip, &zw);
+    putStr(&xml, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+    putStr(&xml, "<model unit=\"millimeter\" xml:lang=\"en-US\" xmlns=\"http://schemas.microsoft.com/3dmanufacturing/core/2015/02\">\n");
+    putStr(&xml, "<resources>\n<object id=\"1\" type=\"model\">\n<mesh>\n<vertices>\n");
+    writeBands(mesh, mesh.n_verts, modelVertsBand, &xml, n_threads);
+    putStr(&xml, "</vertices>\n<triangles>\n");
+    writeBands(mesh, mesh.n_faces, modelFacesBand, &xml, n_threads);
+    putStr(&xml, "</triangles>\n</mesh>\n</object>\n</resources>\n<build>\n<item objectid=\"1\"/>\n</build>\n</model>\n");
+    outBufFree(&xml);
+    zipEndEntry(&zw);
+    zipClose(&zw);
+}
+
+static void writeMesh(MeshSource mesh, LithoFormat format, OutBuf* ob, int argc, char* argv[], int n_threads) {
+    if (format == LITHO_FORMAT_STL) {
+        writeStl(mesh, ob, n_threads);
+    } else if (format == LITHO_FORMAT_3MF) {
+        write3mf(mesh, ob, n_threads);
+    } else {
+        writeObj(mesh, ob, argc, argv, n_threads);
+    }
+}
+
+static int saveMesh(MeshSource mesh, LithoFormat format, const char* filename, int argc, char* argv[], int n_threads, Timings* timings) {
+    FILE *f = fopen(filename, "wb");
+    if (f == NULL) {
+        return 0;
+    }
+    double start = phaseStart(timings);
+    OutBuf ob = outBufToFile(f);
+    writeMesh(mesh, format, &ob, argc, argv, n_threads);
+    outBufFree(&ob);
+    long size = timings ? ftell(f) : 0;
+    int written = !ferror(f); // a failed fwrite (like a full disk) leaves nothing buffered for fclose to fail on
+    int closed = fclose(f) == 0;
+    phaseEnd(timings, PHASE_WRITE, start, size > 0 ? size : 0, mesh.n_verts);
+    return written && closed;
+}
+// saveMesh through a buffer the caller keeps, for saving one mesh after another without a new buffer each time
+static int saveMeshBuffered(MeshSource mesh, LithoFormat format, const char* filename, int argc, char* argv[], int n_threads, OutBuf* ob) {
+    FILE *f = fopen(filename, "wb");
+    if (f == NULL) {
+        return 0;
+    }
+    setvbuf(f, NULL, _IONBF, 0);
+    ob->flush = flushToFile;
+    ob->ctx = f;
+    writeMesh(mesh, format, ob, argc, argv, n_threads);
+    outBufFlush(ob);
+    ob->ctx = NULL;
+    int written = !ferror(f);
+    return fclose(f) == 0 && written;
+}
+
@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+
+// Buffered text/binary output for the mesh writers.
+// Numbers are formatted by hand instead of going through printf, and the buffer is handed to a
+// flush function in large blocks (a file, or the zip compressor for 3mf). A buffer without a
+// flush function just grows, for formatting a piece of output in memory.
+
+#define OUTBUF_SIZE (1 << 22)
+#define OUTBUF_MAX_ITEM 64 // most bytes a single putFloat/putInt call can write
+
+typedef void (*FlushFn)(void* ctx, const char* data, size_t len);
+
+typedef struct {
+    char* buf;
+    size_t len;
+    size_t cap;
+    FlushFn flush;
+    void* ctx;
+} OutBuf;
+
+static void flushToFile(void* ctx, const char* data, size_t len) {
+    fwrite(data, 1, len, (FILE*)ctx);
+}
+
+static OutBuf outBufInit(FlushFn flush, void* ctx) {
+    return (OutBuf){.buf = (char*)malloc(OUTBUF_SIZE), .len = 0, .cap = OUTBUF_SIZE, .flush = flush, .ctx = ctx};
+}
+static OutBuf outBufToFile(FILE* f) {
+    setvbuf(f, NULL, _IONBF, 0); // our buffer is big enough, skip the stdio copy
+    return outBufInit(flushToFile, f);
+}
+static OutBuf outBufInMemory(size_t cap) {
+    return (OutBuf){.buf = (char*)malloc(cap), .len = 0, .cap = cap, .flush = NULL, .ctx = NULL};
+}
+static void outBufFlush(OutBuf* ob) {
+    if (ob->flush && ob->len > 0) {
+        ob->flush(ob->ctx, ob->buf, ob->len);
+        ob->len = 0;
+    }
+}
+static void outBufFree(OutBuf* ob) {
+    outBufFlush(ob);
+    free(ob->buf);
+    ob->buf = NULL;
+}
+static char* outBufReserve(OutBuf* ob, size_t n) { // returns where the next n bytes go
+    if (ob->len + n > ob->cap) {
+        if (ob->flush) {
+            outBufFlush(ob);
+        } else {
+            while (ob->len + n > ob->cap) {
+                ob->cap *= 2;
+            }
+            ob->buf = (char*)realloc(ob->buf, ob->cap);
+        }
+    }
+    return ob->buf + ob->len;
+}
+
+static void putBytes(OutBuf* ob, const void* data, size_t n) {
+    if (ob->flush && n > ob->cap/2) { // big blocks go straight to the flush function
+        outBufFlush(ob);
+        ob->flush(ob->ctx, (const char*)data, n);
+        return;
+    }
+    memcpy(outBufReserve(ob, n), data, n);
+    ob->len += n;
+}
+static void putStr(OutBuf* ob, const char* s) {
+    putBytes(ob, s, strlen(s));
+}
+static inline void putChar(OutBuf* ob, char c) {
+    *outBufReserve(ob, 1) = c;
+    ob->len++;
+}
+
+static const char digitPairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static inline char* writeU64(char* p, uint64_t v) { // writes v in decimal, returns the end
+    char tmp[20];
+    char* t = tmp + sizeof(tmp);
+    while (v >= 100) {
+        int d = (v % 100)*2;
+        v /= 100;
+        *--t = digitPairs[d + 1];
+        *--t = digitPairs[d];
+    }
+    if (v >= 10) {
+        *--t = digitPairs[v*2 + 1];
+        *--t = digitPairs[v*2];
+    } else {
+        *--t = '0' + v;
+    }
+    int n = tmp + sizeof(tmp) - t;
+    memcpy(p, t, n);
+    return p + n;
+}
+
+static inline void putInt(OutBuf* ob, int v) { // same as printf("%d")
+    char* p = outBufReserve(ob, OUTBUF_MAX_ITEM);
+    char* start = p;
+    uint64_t u = v;
+    if (v < 0) {
+        *p++ = '-';
+        u = -(int64_t)v;
+    }
+    p = writeU64(p, u);
+    ob->len += p - start;
+}
+
+// same output as printf("%f") on a float.
+// a float's 24 bit mantissa times 10^6 (15625 * 2^6) fits in a double's 53 bits, so the
+// scaling is exact and rounding it to an integer matches printf's correctly rounded result,
+// ties to even included.
+static inline void putFloat(OutBuf* ob, float f) {
+    char* p = outBufReserve(ob, OUTBUF_MAX_ITEM);
+    char* start = p;
+    double d = f;
+    if (!(fabs(d) < 1e12)) { // inf, nan, or too big for the integer path
+        ob->len += snprintf(p, OUTBUF_MAX_ITEM, "%f", d);
+        return;
+    }
+    if (signbit(d)) { // printf keeps the sign of negative values that round to zero
+        *p++ = '-';
+        d = -d;
+    }
+    uint64_t q = (uint64_t)nearbyint(d*1e6);
+    p = writeU64(p, q/1000000);
+    uint32_t frac = q%1000000;
+    *p++ = '.';
+    memcpy(p, digitPairs + (frac/10000)*2, 2);
+    memcpy(p + 2, digitPairs + (frac/100%100)*2, 2);
+    memcpy(p + 4, digitPairs + (frac%100)*2, 2);
+    p += 6;
+    ob->len += p - start;
+}
@@ -1,29 +1,16 @@
 #include <stdio.h>
 #include <math.h>
+#include <stdint.h>
+#include <string.h>
 #include "img.c"
 
 
-typedef struct {
-    int has_frame;
-    int bevel_corners;
-    int pixels_per_vertex;
-    float min_thickness;
-    float max_thickness;
-    float bright_scale;
-    float frame_thickness;
-    float frame_angle;
-    float frame_width;
-    float scale;
-    int flip_x;
-    int flip_y;
-    int flip_z;
-} LithoOptions;
-
-LithoOptions defaultLithoOptions() {
+LithoOptions lithoDefaultOptions() {
     return (LithoOptions){
         .has_frame = 1,
         .bevel_corners = 0,
         .pixels_per_vertex = 2,
+        .filter = LITHO_FILTER_POINT,
         .min_thickness = 3.0,
         .max_thickness = 10,
         .bright_scale = 0.03,
@@ -34,6 +21,14 @@ LithoOptions defaultLithoOptions() {
         .flip_x = 0,
         .flip_y = 1,
         .flip_z = 1,
+        .threads = 0,
+        .max_error = 0,
+        .max_faces = 0,
+        .simplify_error = 0,
+        .curve = LITHO_CURVE_LINEAR,
+        .curve_param = 0,
+        .curve_points = NULL,
+        .n_curve_points = 0,
     };
 }
 
@@ -53,27 +48,28 @@ typedef struct {
     Pos* verts;
     int max_verts;
     int n_verts;
+    int first_vert; // index of verts[0]. nonzero when the vertices before it are generated elsewhere (see LithoMesh)
     Face* faces;
     int max_faces;
     int n_faces;
 } Obj;
-void addVert(Obj* obj, float x, float y, float z) {
-    obj->verts[obj->n_verts++] = (Pos){.x = x, .y = y, .z = z};
+static void addVert(Obj* obj, float x, float y, float z) {
+    obj->verts[obj->n_verts++ - obj->first_vert] = (Pos){.x = x, .y = y, .z = z};
 }
-void addFace(Obj* obj, int v1, int v2, int v3) {
+static void addFace(Obj* obj, int v1, int v2, int v3) {
     obj->faces[obj->n_faces++] = (Face){.v1 = v1, .v2 = v2, .v3 = v3};
 }
 
-void scaleObj(Obj* obj, float scale) {
-    for (int i = 0; i < obj->n_verts; i++) {
+static void scaleObj(Obj* obj, float scale) {
+    for (int i = 0; i < obj->n_verts - obj->first_vert; i++) {
         obj->verts[i].x *= scale;
         obj->verts[i].y *= scale;
         obj->verts[i].z *= scale;
     }
 }
 
-void flipObjX(Obj* obj) {
-    for (int i = 0; i < obj->n_verts; i++) {
+static void flipObjX(Obj* obj) {
+    for (int i = 0; i < obj->n_verts - obj->first_vert; i++) {
         obj->verts[i].x = -obj->verts[i].x;
     }
     for (int i = 0; i < obj->n_faces; i++) {
@@ -83,8 +79,8 @@ void flipObjX(Obj* obj) {
     }
 }
 
-void flipObjY(Obj* obj) {
-    for (int i = 0; i < obj->n_verts; i++) {
+static void flipObjY(Obj* obj) {
+    for (int i = 0; i < obj->n_verts - obj->first_vert; i++) {
         obj->verts[i].y = -obj->verts[i].y;
     }
     for (int i = 0; i < obj->n_faces; i++) {
@@ -94,8 +90,8 @@ void flipObjY(Obj* obj) {
     }
 }
 
-void flipObjZ(Obj* obj) {
-    for (int i = 0; i < obj->n_verts; i++) {
+static void flipObjZ(Obj* obj) {
+    for (int i = 0; i < obj->n_verts - obj->first_vert; i++) {
         obj->verts[i].z = -obj->verts[i].z;
     }
     for (int i = 0; i < obj->n_faces; i++) {
@@ -105,9 +101,59 @@ void flipObjZ(Obj* obj) {
     }
 }
 
-Obj initLithoObj(const Image img, const LithoOptions opts) {
-    int vwidth = floor(img.width/opts.pixels_per_vertex); // width in vertices
-    int vheight = floor(img.height/opts.pixels_per_vertex); // height in vertices
+static void transformObj(Obj* obj, const LithoOptions opts, Timings* timings) {
+    double start = phaseStart(timings);
+    if (opts.scale != 1.0) {
+        scaleObj(obj, opts.scale);
+    }
+    if (opts.flip_x) {
+        flipObjX(obj);
+    }
+    if (opts.flip_y) {
+        flipObjY(obj);
+    }
+    if (opts.flip_z) {
+        flipObjZ(obj);
+    }
+    int n_verts = obj->n_verts - obj->first_vert;
+    phaseEnd(timings, PHASE_TRANSFORM, start, sizeof(Pos)*n_verts + sizeof(Face)*obj->n_faces, n_verts);
+}
+static inline Pos transformPos(Pos p, const LithoOptions opts) { // transformObj for a single vertex
+    if (opts.scale != 1.0) {
+        p.x *= opts.scale;
+        p.y *= opts.scale;
+        p.z *= opts.scale;
+    }
+    if (opts.flip_x) {
+        p.x = -p.x;
+    }
+    if (opts.flip_y) {
+        p.y = -p.y;
+    }
+    if (opts.flip_z) {
+        p.z = -p.z;
+    }
+    return p;
+}
+
+typedef struct { // everything needed to place the image grid vertices
+    Image brightness; // one value per grid vertex
+    LithoOptions opts;
+    int vwidth;
+    int vheight;
+    float pixel_mean;
+    float pixel_var;
+    double pixel_max;
+    float max_pixel_brightness;
+    float* height_lut; // height for each brightness level, 256 of them, or 65536 for 16 bit brightness
+    int* index_map; // 1-based vertex index of each grid point, or 0 if it was left out. NULL when every point is a vertex, in row order
+    Timings* timings; // where the phases that use the grid are timed, NULL for none
+} LithoGrid;
+
+static Obj initLithoObj(const LithoGrid* grid) {
+    const LithoOptions opts = grid->opts;
+    int vwidth = grid->vwidth; // width in vertices
+    int vheight = grid->vheight; // height in vertices
     int max_verts = 0;
     if (opts.has_frame == 1) {
         // vertices: image vertices, upper frame perimeter vertices, 4 backside corners, 8 inner frame vertices, 8 outer frame vertices, 8 backside frame perimeter vertices, 
@@ -118,33 +164,184 @@ Obj initLithoObj(const Image img, const LithoOptions opts) {
     int max_faces = max_verts*2 + 100; // seems to work
     Pos* verts = (Pos*)malloc(sizeof(Pos)*max_verts);
     Face* faces = (Face*)malloc(sizeof(Face)*max_faces);
-    return (Obj){ .verts = verts, .max_verts = max_verts, .n_verts = 0, .faces = faces, .max_faces = max_faces, .n_faces = 0};
+    return (Obj){ .verts = verts, .max_verts = max_verts, .n_verts = 0, .first_vert = 0, .faces = faces, .max_faces = max_faces, .n_faces = 0};
 }
 
-Obj makeLithoObj(Image img, LithoOptions opts) {
-    Obj obj = initLithoObj(img, opts);
-    Image brightness = rgbToBrightness(img);
-
-    float pixel_mean = getPixelMean(brightness, 0);
-    float pixel_var = getPixelVar(brightness, pixel_mean, 0);
-    float max_pixel_brightness = opts.bright_scale * (getPixelMinMax(brightness, 0).max - pixel_mean) / pixel_var;
+// Tone curves remap brightness (0 to 255) before the height formula. Whatever the curve, it ends
+// up in LithoGrid.height_lut, so the grid only ever does one table lookup per vertex. 16 bit
+// brightness has a level every 1/257 of that, and a table entry for each.
+static float applyCurve(float b, const LithoOptions* opts) {
+    float t = b/255;
+    switch (opts->curve) {
+        case LITHO_CURVE_GAMMA: {
+            float gamma = opts->curve_param > 0 ? opts->curve_param : 2.2;
+            return 255*powf(t, gamma);
+        }
+        case LITHO_CURVE_LOG: {
+            float strength = opts->curve_param > 0 ? opts->curve_param : 10;
+            return 255*log1pf(strength*t)/log1pf(strength);
+        }
+        case LITHO_CURVE_CSV: { // linear between the points, flat past the ends
+            const float* pts = opts->curve_points;
+            int n = opts->n_curve_points;
+            if (b <= pts[0]) {
+                return pts[1];
+            }
+            for (int i = 1; i < n; i++) {
+                if (b <= pts[2*i]) {
+                    float x0 = pts[2*i - 2], y0 = pts[2*i - 1], x1 = pts[2*i], y1 = pts[2*i + 1];
+                    return x1 > x0 ? y0 + (b - x0)/(x1 - x0)*(y1 - y0) : y1;
+                }
+            }
+            return pts[2*n - 1];
+        }
+        default:
+            return b;
+    }
+}
+// the height table and backside depth for grid->opts, replacing any from earlier options
+static void buildHeightLut(LithoGrid* grid) {
+    double start = phaseStart(grid->timings);
+    const LithoOptions opts = grid->opts;
+    const int n_levels = grid->brightness.type == LITHO_PIXELS_U16 ? WIDE_LEVELS : 256;
+    grid->max_pixel_brightness = opts.bright_scale * (grid->pixel_max - grid->pixel_mean) / grid->pixel_var;
+    free(grid->height_lut);
+    grid->height_lut = (float*)malloc(sizeof(float)*n_levels);
+    for (int b = 0; b < n_levels; b++) {
+        float level = n_levels == 256 ? b : b*(255.0/(WIDE_LEVELS - 1));
+        float v = opts.curve == LITHO_CURVE_LINEAR ? level : applyCurve(level, &opts);
+        // float h = -((v - pixel_mean)/pixel_var)*opts.bright_scale + opts.min_thickness;
+        grid->height_lut[b] = fmax(-((v - grid->pixel_mean))*opts.bright_scale + opts.min_thickness, -opts.min_thickness);
+    }
+    phaseEnd(grid->timings, PHASE_HEIGHTS, start, sizeof(float)*n_levels, 0);
+}
 
-    int vwidth = brightness.width/opts.pixels_per_vertex;
-    int vheight = brightness.height/opts.pixels_per_vertex;
+// reads a tone curve from a csv file of "input,output" brightness pairs, one per line.
+// lines that don't start with two numbers (like a header) are skipped. returns 0 if there's no usable curve.
+int lithoLoadCurveCsv(const char* filename, LithoOptions* opts) {
+    FILE* f = fopen(filename, "r");
+    if (!f) {
+        return 0;
+    }
+    int n = 0, cap = 64;
+    float* pts = (float*)malloc(sizeof(float)*2*cap);
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        float in, out;
+        if (sscanf(line, " %f , %f", &in, &out) != 2 && sscanf(line, " %f %f", &in, &out) != 2) {
+            continue;
+        }
+        if (n == cap) {
+            cap *= 2;
+            pts = (float*)realloc(pts, sizeof(float)*2*cap);
+        }
+        int i = n++;
+        while (i > 0 && pts[2*i - 2] > in) { // keep sorted by input
+            pts[2*i] = pts[2*i - 2];
+            pts[2*i + 1] = pts[2*i - 1];
+            i--;
+        }
+        pts[2*i] = in;
+        pts[2*i + 1] = out;
+    }
+    fclose(f);
+    if (n == 0) {
+        free(pts);
+        return 0;
+    }
+    opts->curve = LITHO_CURVE_CSV;
+    opts->curve_points = pts;
+    opts->n_curve_points = n;
+    return 1;
+}
 
-    for (int y = 0; y < vheight; y += 1) {
-        for (int x = 0; x < vwidth; x += 1) { // face vertices
-            int b = brightness.img[img.width*y*opts.pixels_per_vertex + x*opts.pixels_per_vertex];
-            // float h = -((b - pixel_mean)/pixel_var)*opts.bright_scale + opts.min_thickness;
-            float h = fmax(-((b - pixel_mean))*opts.bright_scale + opts.min_thickness, -opts.min_thickness);
+// the grid needs at least 2 vertices each way, anything smaller can't be made into a mesh
+static int imageFitsGrid(const Image img, int pixels_per_vertex) {
+    return img.width/pixels_per_vertex >= 2 && img.height/pixels_per_vertex >= 2;
+}
+// NULL if a mesh can be made with opts, otherwise what's wrong with them
+static const char* lithoOptionsError(const LithoOptions* opts) {
+    if (opts->pixels_per_vertex < 1) {
+        return "--pixels_per_vertex has to be at least 1";
+    }
+    if (!(opts->scale > 0) || opts->frame_width < 0 || opts->frame_thickness < 0 || opts->max_faces < 0) {
+        return "--scale has to be above 0, and the frame sizes and --max_faces can't be negative";
+    }
+    if (opts->curve == LITHO_CURVE_CSV && (!opts->curve_points || opts->n_curve_points < 1)) {
+        return "a csv --curve needs at least one point";
+    }
+    return NULL;
+}
 
-            addVert(&obj, x, h, y);
-            if ((x != 0) && (y != 0)) {
-                addFace(&obj, obj.n_verts, obj.n_verts - vwidth, obj.n_verts - vwidth - 1);  // right hand rule gives the right normal
-                addFace(&obj, obj.n_verts, obj.n_verts - vwidth - 1, obj.n_verts - 1);
-            }
-        }
+// the brightness at each grid vertex and its statistics, without heights yet. img is left as it is
+static LithoGrid sampleLithoGrid(const Image img, LithoOptions opts, Timings* timings) {
+    Histogram hist;
+    double start = phaseStart(timings);
+    Image brightness = sampleBrightness(img, opts.pixels_per_vertex, opts.filter, resolveThreads(opts.threads), &hist);
+    phaseEnd(timings, PHASE_SAMPLE, start, (uint64_t)img.width*img.height*img.channels*pixelTypeSize(img.type), (uint64_t)brightness.width*brightness.height);
+    start = phaseStart(timings);
+    float pixel_mean = histogramMean(&hist);
+    LithoGrid grid = {
+        .brightness = brightness,
+        .opts = opts,
+        .vwidth = brightness.width,
+        .vheight = brightness.height,
+        .pixel_mean = pixel_mean,
+        .pixel_var = histogramVar(&hist, pixel_mean),
+        .pixel_max = histogramMax(&hist),
+        .height_lut = NULL,
+        .index_map = NULL,
+        .timings = timings,
+    };
+    phaseEnd(timings, PHASE_STATS, start, 0, 0);
+    freeHistogram(&hist);
+    return grid;
+}
+// frees img's pixels as soon as they've been read, the grid only needs the brightness at its vertices
+static LithoGrid makeLithoGrid(Image* img, LithoOptions opts, Timings* timings) {
+    LithoGrid grid = sampleLithoGrid(*img, opts, timings);
+    freeImage(img);
+    buildHeightLut(&grid);
+    return grid;
+}
+static void freeLithoGrid(LithoGrid* grid) {
+    stbi_image_free(grid->brightness.img);
+    grid->brightness.img = NULL;
+    free(grid->height_lut);
+    grid->height_lut = NULL;
+    free(grid->index_map);
+    grid->index_map = NULL;
+}
+static inline int gridIndex(const LithoGrid* grid, int x, int y) { // 1-based vertex index of grid point (x, y)
+    if (grid->index_map) {
+        return grid->index_map[y*grid->vwidth + x];
+    }
+    return y*grid->vwidth + x + 1;
+}
+static inline float gridHeight(const LithoGrid* grid, int x, int y) {
+    size_t i = (size_t)y*grid->vwidth + x;
+    if (grid->brightness.type == LITHO_PIXELS_U16) {
+        return grid->height_lut[((const uint16_t*)grid->brightness.img)[i]];
     }
+    return grid->height_lut[grid->brightness.img[i]];
+}
+static void gridHeightRow(const LithoGrid* grid, int x, int y, int n, float* out) { // gridHeight for n vertices along a row
+    size_t start = (size_t)y*grid->vwidth + x;
+    if (grid->brightness.type == LITHO_PIXELS_U16) {
+        heightRow16((const uint16_t*)grid->brightness.img + start, n, grid->height_lut, out);
+        return;
+    }
+    heightRow(grid->brightness.img + start, n, grid->height_lut, out);
+}
+
+// frame and backside geometry. expects the grid vertices to come first (see gridIndex), with every
+// point on the edge of the grid present, and its own vertices to follow them.
+static void addLithoFrame(Obj* obj_ptr, const LithoGrid* grid) {
+    Obj obj = *obj_ptr;
+    const LithoOptions opts = grid->opts;
+    const int vwidth = grid->vwidth;
+    const int vheight = grid->vheight;
+    const float max_pixel_brightness = grid->max_pixel_brightness;
     if (opts.has_frame == 1) {
         // the horizontal distance to the inner frame edge which gives the desired bevel angle
         float hdist = opts.frame_thickness / (2*tan(opts.frame_angle * 3.14159 / 180.0)); 
@@ -195,33 +392,32 @@ Obj makeLithoObj(Image img, LithoOptions opts) {
         for (int x = 0; x < vwidth; x += 1) {
             addVert(&obj, x+0.01, opts.frame_thickness/2, -hdist);
             if (x != 0) {
-                addFace(&obj, x, x+1, fpnt+x);
-                addFace(&obj, fpnt+x+1, fpnt+x, x+1);
+                addFace(&obj, gridIndex(grid, x - 1, 0), gridIndex(grid, x, 0), fpnt+x);
+                addFace(&obj, fpnt+x+1, fpnt+x, gridIndex(grid, x, 0));
             }
         }
         int fpst = obj.n_verts; // frame perimeter top south
         for (int x = 0; x < vwidth; x += 1) {
-            int bottomx = x + vwidth*(vheight - 1);
             addVert(&obj, x+0.01, opts.frame_thickness/2, vheight+hdist);
             if (x != 0) {
-                addFace(&obj, bottomx, fpst+x, bottomx+1);
-                addFace(&obj, fpst+x+1, bottomx+1, fpst+x);
+                addFace(&obj, gridIndex(grid, x - 1, vheight - 1), fpst+x, gridIndex(grid, x, vheight - 1));
+                addFace(&obj, fpst+x+1, gridIndex(grid, x, vheight - 1), fpst+x);
             }
         }
         int fpwt = obj.n_verts; // frame perimeter top west side
         for (int y = 0; y < vheight; y += 1) {
             addVert(&obj, -hdist, opts.frame_thickness/2, y+0.01);
             if (y != 0) {
-                addFace(&obj, y*vwidth + 1, (y - 1)*vwidth + 1, fpwt + y);
-                addFace(&obj, fpwt + y, fpwt + y + 1, y*vwidth + 1);
+                addFace(&obj, gridIndex(grid, 0, y), gridIndex(grid, 0, y - 1), fpwt + y);
+                addFace(&obj, fpwt + y, fpwt + y + 1, gridIndex(grid, 0, y));
             }
         }
         int fpet = obj.n_verts; // frame perimeter top east side
         for (int y = 0; y < vheight; y += 1) {
             addVert(&obj, vwidth + hdist, opts.frame_thickness/2, y+0.01);
             if (y != 0) {
-                addFace(&obj, (y + 1)*vwidth, fpet + y, y*vwidth);
-                addFace(&obj, (y + 1)*vwidth, fpet + y + 1, fpet + y);
+                addFace(&obj, gridIndex(grid, vwidth - 1, y), fpet + y, gridIndex(grid, vwidth - 1, y - 1));
+                addFace(&obj, gridIndex(grid, vwidth - 1, y), fpet + y + 1, fpet + y);
             }
         }
         int bp0 = obj.n_verts; // start of backside vertices
@@ -249,14 +445,14 @@ Obj makeLithoObj(Image img, LithoOptions opts) {
         addFace(&obj, bp0 + 4, bp0 + 7, bp0 + 11); 
         addFace(&obj, bp0 + 4, bp0 + 2, bp0 + 7); 
         if (opts.bevel_corners == 1) {
-            addFace(&obj, 1, fpnt + 1, ifc0 + 3); // topside corner connections
-            addFace(&obj, 1, ifc0 + 3, fpwt + 1);
-            addFace(&obj, vwidth, ifc0 + 4, fpnt + vwidth);
-            addFace(&obj, vwidth, fpet + 1, ifc0 + 4);
-            addFace(&obj, vwidth*vheight, ifc0 + 8, fpet + vheight);
-            addFace(&obj, vwidth*vheight, fpst + vwidth, ifc0 + 8);
-            addFace(&obj, vwidth*(vheight - 1) + 1, fpwt + vheight, ifc0 + 7);
-            addFace(&obj, vwidth*(vheight - 1) + 1, ifc0 + 7, fpst + 1);
+            addFace(&obj, gridIndex(grid, 0, 0), fpnt + 1, ifc0 + 3); // topside corner connections
+            addFace(&obj, gridIndex(grid, 0, 0), ifc0 + 3, fpwt + 1);
+            addFace(&obj, gridIndex(grid, vwidth - 1, 0), ifc0 + 4, fpnt + vwidth);
+            addFace(&obj, gridIndex(grid, vwidth - 1, 0), fpet + 1, ifc0 + 4);
+            addFace(&obj, gridIndex(grid, vwidth - 1, vheight - 1), ifc0 + 8, fpet + vheight);
+            addFace(&obj, gridIndex(grid, vwidth - 1, vheight - 1), fpst + vwidth, ifc0 + 8);
+            addFace(&obj, gridIndex(grid, 0, vheight - 1), fpwt + vheight, ifc0 + 7);
+            addFace(&obj, gridIndex(grid, 0, vheight - 1), ifc0 + 7, fpst + 1);
             addFace(&obj, bp0 + 1, bp0 + 5, ifc0 + 1); // bottom side corner connections
             addFace(&obj, bp0 + 1, ifc0 + 1, bp0 + 6);
             addFace(&obj, bp0 + 2, bp0 + 8, ifc0 + 2);
@@ -267,12 +463,12 @@ Obj makeLithoObj(Image img, LithoOptions opts) {
             addFace(&obj, bp0 + 3, bp0 + 10, ifc0 + 5);
         } else {
             addFace(&obj, fpwt + 1, fpnt + 1, ifc0 + 3); // topside corner connections
-            addFace(&obj, fpwt + 1, 1, fpnt + 1);
+            addFace(&obj, fpwt + 1, gridIndex(grid, 0, 0), fpnt + 1);
             addFace(&obj, fpnt + vwidth, fpet + 1, ifc0 + 4);
-            addFace(&obj, fpnt + vwidth, vwidth, fpet + 1);
-            addFace(&obj, fpet + vheight, vwidth*vheight, fpst + vwidth);
+            addFace(&obj, fpnt + vwidth, gridIndex(grid, vwidth - 1, 0), fpet + 1);
+            addFace(&obj, fpet + vheight, gridIndex(grid, vwidth - 1, vheight - 1), fpst + vwidth);
             addFace(&obj, fpst + vwidth, ifc0 + 8, fpet + vheight);
-            addFace(&obj, vwidth*(vheight - 1) + 1, fpwt + vheight, fpst + 1);
+            addFace(&obj, gridIndex(grid, 0, vheight - 1), fpwt + vheight, fpst + 1);
             addFace(&obj, fpst + 1, fpwt + vheight, ifc0 + 7);
             addFace(&obj, bp0 + 6, bp0 + 5, ifc0 + 1); // topside corner connections
             addFace(&obj, bp0 + 6, bp0 + 1, bp0 + 5);
@@ -290,10 +486,10 @@ Obj makeLithoObj(Image img, LithoOptions opts) {
             addVert(&obj, x, -max_pixel_brightness, 0);
             addVert(&obj, x, -max_pixel_brightness, vheight - 1);
             if (x != 0) {
-                addFace(&obj, obj.n_verts - 1, (obj.n_verts - 1) - 2, x);
-                addFace(&obj, obj.n_verts - 1, x, x + 1);
-                addFace(&obj, obj.n_verts, obj.n_verts - vwidth - x - 1, obj.n_verts - vwidth - x - 2);
-                addFace(&obj, obj.n_verts, obj.n_verts - vwidth - x - 2, obj.n_verts - 2);
+                addFace(&obj, obj.n_verts - 1, (obj.n_verts - 1) - 2, gridIndex(grid, x - 1, 0));
+                addFace(&obj, obj.n_verts - 1, gridIndex(grid, x - 1, 0), gridIndex(grid, x, 0));
+                addFace(&obj, obj.n_verts, gridIndex(grid, x, vheight - 1), gridIndex(grid, x - 1, vheight - 1));
+                addFace(&obj, obj.n_verts, gridIndex(grid, x - 1, vheight - 1), obj.n_verts - 2);
             }
         }
         int by0 = obj.n_verts + 1; // above
@@ -301,24 +497,277 @@ Obj makeLithoObj(Image img, LithoOptions opts) {
             addVert(&obj, 0, -max_pixel_brightness, y);
             addVert(&obj, vwidth - 1, -max_pixel_brightness, y);
             if (y != 1) {
-                addFace(&obj, obj.n_verts - 1, y*vwidth + 1, (y-1)*vwidth + 1);
-                addFace(&obj, obj.n_verts - 1, (y-1)*vwidth + 1, (obj.n_verts - 1) - 2);
-                addFace(&obj, obj.n_verts, y*vwidth, (y + 1)*vwidth);
-                addFace(&obj, obj.n_verts, obj.n_verts - 2, y*vwidth);
+                addFace(&obj, obj.n_verts - 1, gridIndex(grid, 0, y), gridIndex(grid, 0, y - 1));
+                addFace(&obj, obj.n_verts - 1, gridIndex(grid, 0, y - 1), (obj.n_verts - 1) - 2);
+                addFace(&obj, obj.n_verts, gridIndex(grid, vwidth - 1, y - 1), gridIndex(grid, vwidth - 1, y));
+                addFace(&obj, obj.n_verts, obj.n_verts - 2, gridIndex(grid, vwidth - 1, y - 1));
             }
         }
-        addFace(&obj, bx0, by0, 1); // connecting the empty squares between the y-parallel backside perimeter vertices and the x-parallel backside vertices
-        addFace(&obj, by0, vwidth + 1, 1);
-        addFace(&obj, vwidth*(vheight-2) + 1, by0 + 2*(vheight - 3), bx0+1);
-        addFace(&obj, vwidth*(vheight-2) + 1, bx0 + 1, vwidth*(vheight - 1) + 1);
-        addFace(&obj, by0 + 1, vwidth, 2*vwidth);
-        addFace(&obj, by0 + 1, bx0+2*(vwidth-1), vwidth);
-        addFace(&obj, bx0 + 2*vwidth - 1, vwidth*(vheight-1), vwidth*vheight);
-        addFace(&obj, bx0 + 2*vwidth - 1, by0 + 2*(vheight - 3) - 1, vwidth*(vheight-1));
+        addFace(&obj, bx0, by0, gridIndex(grid, 0, 0)); // connecting the empty squares between the y-parallel backside perimeter vertices and the x-parallel backside vertices
+        addFace(&obj, by0, gridIndex(grid, 0, 1), gridIndex(grid, 0, 0));
+        addFace(&obj, gridIndex(grid, 0, vheight - 2), by0 + 2*(vheight - 3), bx0+1);
+        addFace(&obj, gridIndex(grid, 0, vheight - 2), bx0 + 1, gridIndex(grid, 0, vheight - 1));
+        addFace(&obj, by0 + 1, gridIndex(grid, vwidth - 1, 0), gridIndex(grid, vwidth - 1, 1));
+        addFace(&obj, by0 + 1, bx0+2*(vwidth-1), gridIndex(grid, vwidth - 1, 0));
+        addFace(&obj, bx0 + 2*vwidth - 1, gridIndex(grid, vwidth - 1, vheight - 2), gridIndex(grid, vwidth - 1, vheight - 1));
+        addFace(&obj, bx0 + 2*vwidth - 1, by0 + 2*(vheight - 3) - 1, gridIndex(grid, vwidth - 1, vheight - 2));
         addFace(&obj, bx0, bx0 + 2*vwidth - 1,  bx0 + 1); // 2 backside faces
         addFace(&obj, bx0,  bx0 + 2*vwidth - 2, bx0 + 2*vwidth - 1);
     }
 
+    *obj_ptr = obj;
+}
+
+// Adaptive grid for opts.max_error. The grid is covered by a quadtree of square cells, and a cell is
+// split until the surface through its corners and center is within max_error/2 of every grid point
+// it covers. Each leaf becomes a fan around its center, through its corners and any vertices its
+// smaller neighbours put on its edges, so there are no cracks between cells of different sizes.
+// Those extra edge vertices can move the surface by up to the error of the leaf they sit on,
+// which is why cells are held to half the error. Every point on the edge of the grid is kept so
+// the frame can stitch to it the same way as to the full grid.
+typedef struct {
+    int x0;
+    int y0;
+    int size;
+} QuadCell;
+
+typedef struct {
+    const LithoGrid* grid;
+    float* heights;
+    char* active;
+    QuadCell* leaves;
+    int n_leaves;
+    float tolerance;
+} Quadtree;
+
+static float quadHeight(const Quadtree* qt, int x, int y) {
+    return qt->heights[y*qt->grid->vwidth + x];
+}
+
+static float fanError(const Quadtree* qt, int x0, int y0, int size) { // largest error of the 4 triangle fan over a cell
+    int r = size/2;
+    int cx = x0 + r, cy = y0 + r;
+    float hc = quadHeight(qt, cx, cy);
+    float corner[4] = {quadHeight(qt, x0, y0), quadHeight(qt, x0 + size, y0), quadHeight(qt, x0 + size, y0 + size), quadHeight(qt, x0, y0 + size)};
+    float max_err = 0;
+    for (int y = y0; y <= y0 + size; y++) {
+        for (int x = x0; x <= x0 + size; x++) {
+            int dx = x - cx, dy = y - cy;
+            float h;
+            if (dy <= -abs(dx)) { // top triangle, between corners 0 and 1
+                float t = -dy/(float)r;
+                h = hc + t*((corner[0] + corner[1])/2 - hc) + (dx/(float)(2*r))*(corner[1] - corner[0]);
+            } else if (dy >= abs(dx)) { // bottom, corners 3 and 2
+                float t = dy/(float)r;
+                h = hc + t*((corner[3] + corner[2])/2 - hc) + (dx/(float)(2*r))*(corner[2] - corner[3]);
+            } else if (dx < 0) { // left, corners 0 and 3
+                float t = -dx/(float)r;
+                h = hc + t*((corner[0] + corner[3])/2 - hc) + (dy/(float)(2*r))*(corner[3] - corner[0]);
+            } else { // right, corners 1 and 2
+                float t = dx/(float)r;
+                h = hc + t*((corner[1] + corner[2])/2 - hc) + (dy/(float)(2*r))*(corner[2] - corner[1]);
+            }
+            float err = fabsf(h - quadHeight(qt, x, y));
+            if (err > max_err) {
+                max_err = err;
+                if (max_err > qt->tolerance) {
+                    return max_err;
+                }
+            }
+        }
+    }
+    return max_err;
+}
+
+static void refineQuadCell(Quadtree* qt, int x0, int y0, int size) {
+    int last_x = qt->grid->vwidth - 1, last_y = qt->grid->vheight - 1;
+    if (x0 >= last_x || y0 >= last_y) {
+        return;
+    }
+    int inside = x0 + size <= last_x && y0 + size <= last_y;
+    if (size > 1 && (!inside || fanError(qt, x0, y0, size) > qt->tolerance)) {
+        int half = size/2;
+        refineQuadCell(qt, x0, y0, half);
+        refineQuadCell(qt, x0 + half, y0, half);
+        refineQuadCell(qt, x0, y0 + half, half);
+        refineQuadCell(qt, x0 + half, y0 + half, half);
+        return;
+    }
+    int w = qt->grid->vwidth;
+    qt->active[y0*w + x0] = 1;
+    qt->active[y0*w + x0 + size] = 1;
+    qt->active[(y0 + size)*w + x0] = 1;
+    qt->active[(y0 + size)*w + x0 + size] = 1;
+    if (size > 1) {
+        qt->active[(y0 + size/2)*w + x0 + size/2] = 1;
+    }
+    qt->leaves[qt->n_leaves++] = (QuadCell){.x0 = x0, .y0 = y0, .size = size};
+}
+
+static void addAdaptiveGrid(Obj* obj, LithoGrid* grid) {
+    const int w = grid->vwidth, h = grid->vheight;
+    Quadtree qt = {.grid = grid, .tolerance = grid->opts.max_error/2, .n_leaves = 0};
+    qt.heights = (float*)malloc(sizeof(float)*w*h);
+    qt.active = (char*)calloc(w*h, 1);
+    qt.leaves = (QuadCell*)malloc(sizeof(QuadCell)*(w - 1)*(h - 1));
+    for (int y = 0; y < h; y++) {
+        gridHeightRow(grid, 0, y, w, qt.heights + y*w);
+    }
+    int root = 1;
+    while (root < w - 1 || root < h - 1) {
+        root *= 2;
+    }
+    refineQuadCell(&qt, 0, 0, root);
+    for (int x = 0; x < w; x++) {
+        qt.active[x] = 1;
+        qt.active[(h - 1)*w + x] = 1;
+    }
+    for (int y = 0; y < h; y++) {
+        qt.active[y*w] = 1;
+        qt.active[y*w + w - 1] = 1;
+    }
+
+    grid->index_map = (int*)calloc(w*h, sizeof(int));
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            if (qt.active[y*w + x]) {
+                addVert(obj, x, qt.heights[y*w + x], y);
+                grid->index_map[y*w + x] = obj->n_verts;
+            }
+        }
+    }
+
+    int* ring = (int*)malloc(sizeof(int)*(4*root + 1));
+    for (int i = 0; i < qt.n_leaves; i++) {
+        QuadCell c = qt.leaves[i];
+        int x0 = c.x0, y0 = c.y0, x1 = c.x0 + c.size, y1 = c.y0 + c.size;
+        if (c.size == 1) { // same two faces as the uniform grid
+            addFace(obj, gridIndex(grid, x1, y1), gridIndex(grid, x1, y0), gridIndex(grid, x0, y0));
+            addFace(obj, gridIndex(grid, x1, y1), gridIndex(grid, x0, y0), gridIndex(grid, x0, y1));
+            continue;
+        }
+        // walk the cell edge down the left side, along the bottom, up the right and back along the top,
+        // which winds the fan the same way as the uniform grid faces
+        int n = 0;
+        for (int y = y0; y < y1; y++) {
+            if (qt.active[y*w + x0]) ring[n++] = gridIndex(grid, x0, y);
+        }
+        for (int x = x0; x < x1; x++) {
+            if (qt.active[y1*w + x]) ring[n++] = gridIndex(grid, x, y1);
+        }
+        for (int y = y1; y > y0; y--) {
+            if (qt.active[y*w + x1]) ring[n++] = gridIndex(grid, x1, y);
+        }
+        for (int x = x1; x > x0; x--) {
+            if (qt.active[y0*w + x]) ring[n++] = gridIndex(grid, x, y0);
+        }
+        int center = gridIndex(grid, x0 + c.size/2, y0 + c.size/2);
+        for (int k = 0; k < n; k++) {
+            addFace(obj, center, ring[k], ring[(k + 1) % n]);
+        }
+    }
+    free(ring);
+    free(qt.heights);
+    free(qt.active);
+    free(qt.leaves);
+}
+
+static Obj initAdaptiveLithoObj(LithoGrid* grid) { // sized for the worst case, where every grid point is kept
+    Obj obj = {0};
+    int max_verts = grid->vwidth*grid->vheight + 2*grid->vwidth + 2*grid->vheight + 4 + 8 + 8 + 8;
+    obj.max_verts = max_verts;
+    obj.max_faces = max_verts*2 + 100;
+    obj.verts = (Pos*)malloc(sizeof(Pos)*obj.max_verts);
+    obj.faces = (Face*)malloc(sizeof(Face)*obj.max_faces);
+    return obj;
+}
+
+static void simplifyObj(Obj* obj, int n_free, int max_faces, float max_error); // simplify.c
+
+// Uniform grid and frame, built on opts.threads threads. Every grid vertex and face index follows
+// from (x, y), so bands of rows are filled straight into their place in the arrays, and the frame
+// is built into the space after the grid at the same time. Same result as building it in order.
+#define GRID_ROWS_PER_TASK 64
+
+typedef struct {
+    Obj* obj;
+    Obj frame; // view of obj's arrays after the grid
+    const LithoGrid* grid;
+} GridBuild;
+
+static void buildGridTask(void* ctx, int task) {
+    GridBuild* build = (GridBuild*)ctx;
+    const LithoGrid* grid = build->grid;
+    const int w = grid->vwidth;
+    if (task == 0) { // the frame only depends on the grid size, so it doesn't have to wait
+        addLithoFrame(&build->frame, grid);
+        return;
+    }
+    int y_start = (task - 1)*GRID_ROWS_PER_TASK;
+    int y_end = y_start + GRID_ROWS_PER_TASK < grid->vheight ? y_start + GRID_ROWS_PER_TASK : grid->vheight;
+    Pos* verts = build->obj->verts;
+    Face* faces = build->obj->faces;
+    float* heights = (float*)malloc(sizeof(float)*w);
+    for (int y = y_start; y < y_end; y++) {
+        gridHeightRow(grid, 0, y, w, heights);
+        for (int x = 0; x < w; x++) { // face vertices
+            int v = y*w + x + 1; // 1-based, like addVert leaves n_verts
+            verts[v - 1] = (Pos){.x = x, .y = heights[x], .z = y};
+            if ((x != 0) && (y != 0)) {
+                int f = 2*((y - 1)*(w - 1) + x - 1);
+                faces[f] = (Face){.v1 = v, .v2 = v - w, .v3 = v - w - 1};  // right hand rule gives the right normal
+                faces[f + 1] = (Face){.v1 = v, .v2 = v - w - 1, .v3 = v - 1};
+            }
+        }
+    }
+    free(heights);
+}
+
+static void addUniformGridAndFrame(Obj* obj, const LithoGrid* grid) {
+    int n_grid = grid->vwidth*grid->vheight;
+    int n_grid_faces = 2*(grid->vwidth - 1)*(grid->vheight - 1);
+    GridBuild build = {.obj = obj, .grid = grid};
+    build.frame = (Obj){
+        .verts = obj->verts + n_grid, .max_verts = obj->max_verts - n_grid, .n_verts = n_grid, .first_vert = n_grid,
+        .faces = obj->faces + n_grid_faces, .max_faces = obj->max_faces - n_grid_faces, .n_faces = 0,
+    };
+    int n_tasks = 1 + (grid->vheight + GRID_ROWS_PER_TASK - 1)/GRID_ROWS_PER_TASK;
+    parallelFor(n_tasks, resolveThreads(grid->opts.threads), buildGridTask, &build);
+    obj->n_verts = build.frame.n_verts;
+    obj->n_faces = n_grid_faces + build.frame.n_faces;
+}
+
+// the whole mesh for grid->opts, grid is left as it was
+static Obj buildLithoObj(LithoGrid* grid) {
+    const LithoOptions opts = grid->opts;
+    Obj obj;
+    int n_grid_verts;
+    double start = phaseStart(grid->timings);
+    if (opts.max_error > 0) {
+        obj = initAdaptiveLithoObj(grid);
+        addAdaptiveGrid(&obj, grid);
+        n_grid_verts = obj.n_verts;
+        phaseEnd(grid->timings, PHASE_GRID, start, sizeof(Pos)*obj.n_verts + sizeof(Face)*obj.n_faces, obj.n_verts);
+        start = phaseStart(grid->timings);
+        int n_faces = obj.n_faces;
+        addLithoFrame(&obj, grid);
+        phaseEnd(grid->timings, PHASE_FRAME, start, sizeof(Pos)*(obj.n_verts - n_grid_verts) + sizeof(Face)*(obj.n_faces - n_faces), obj.n_verts - n_grid_verts);
+        free(grid->index_map); // only there for the frame to find the kept edge points
+        grid->index_map = NULL;
+    } else {
+        obj = initLithoObj(grid);
+        n_grid_verts = grid->vwidth*grid->vheight;
+        addUniformGridAndFrame(&obj, grid);
+        phaseEnd(grid->timings, PHASE_GRID, start, sizeof(Pos)*obj.n_verts + sizeof(Face)*obj.n_faces, obj.n_verts);
+    }
+    if (opts.max_faces > 0 || opts.simplify_error > 0) { // only the image surface is simplified, the frame stays as it is
+        start = phaseStart(grid->timings);
+        int n_verts = obj.n_verts;
+        uint64_t bytes = sizeof(Pos)*obj.n_verts + sizeof(Face)*obj.n_faces;
+        simplifyObj(&obj, n_grid_verts, opts.max_faces, opts.simplify_error);
+        phaseEnd(grid->timings, PHASE_SIMPLIFY, start, bytes, n_verts);
+    }
+
     // if (obj.n_verts != obj.max_verts) {
     //     printf("Warning: allocated %d vertices for the lithophane object, but created %d\n", obj.max_verts, obj.n_verts);
     // }
@@ -326,42 +775,348 @@ Obj makeLithoObj(Image img, LithoOptions opts) {
     //     printf("Warning: allocated %d faces for the lithophane object, but created %d\n", obj.max_faces, obj.n_faces);
     // } 
 
-    // Apply transformations
-    if (opts.scale != 1.0) {
-        scaleObj(&obj, opts.scale);
+    transformObj(&obj, opts, grid->timings);
+    return obj;
+}
+// takes ownership of img's pixels, and frees them once the grid has read them
+static Obj makeLithoObj(Image img, LithoOptions opts, Timings* timings) {
+    LithoGrid grid = makeLithoGrid(&img, opts, timings);
+    Obj obj = buildLithoObj(&grid);
+    freeLithoGrid(&grid);
+    return obj;
+}
+
+// The vertices and faces of a mesh, handed out in index ranges so writers never need the whole mesh in memory.
+// Face vertex indices are 1-based, like in Obj.
+typedef struct {
+    int n_verts;
+    int n_faces;
+    void* ctx;
+    void (*getVerts)(void* ctx, int start, int count, Pos* out);
+    void (*getFaces)(void* ctx, int start, int count, Face* out);
+} MeshSource;
+
+static void objGetVerts(void* ctx, int start, int count, Pos* out) {
+    memcpy(out, ((Obj*)ctx)->verts + start, sizeof(Pos)*count);
+}
+static void objGetFaces(void* ctx, int start, int count, Face* out) {
+    memcpy(out, ((Obj*)ctx)->faces + start, sizeof(Face)*count);
+}
+static MeshSource objSource(Obj* obj) {
+    return (MeshSource){.n_verts = obj->n_verts, .n_faces = obj->n_faces, .ctx = obj, .getVerts = objGetVerts, .getFaces = objGetFaces};
+}
+
+// Heightfield version of makeLithoObj. The grid is stored as one height per vertex, and only the
+// frame and backside geometry is stored as vertices and faces. Grid vertices and faces are made
+// whenever a writer asks for them. When streaming, even the heights aren't stored, they're read
+// straight off the brightness image.
+// Produces the same vertices and faces, in the same order, as makeLithoObj.
+typedef struct {
+    LithoGrid grid; // the sampled brightness is only kept when streaming
+    float* heights; // vwidth*vheight grid heights, before any transforms. NULL when streaming
+    Obj frame; // first_vert is vwidth*vheight, so it lines up after the grid vertices
+    int flip_faces;
+} LithoMesh;
+
+static Obj makeLithoFrame(const LithoGrid* grid) { // frame and backside, before transforms
+    int n_grid = grid->vwidth*grid->vheight;
+    int max_verts = 2*grid->vwidth + 2*grid->vheight + 4 + 8 + 8 + 8;
+    int max_faces = max_verts*2 + 100;
+    Obj frame = {
+        .verts = (Pos*)malloc(sizeof(Pos)*max_verts), .max_verts = max_verts, .n_verts = n_grid, .first_vert = n_grid,
+        .faces = (Face*)malloc(sizeof(Face)*max_faces), .max_faces = max_faces, .n_faces = 0
+    };
+    double start = phaseStart(grid->timings);
+    addLithoFrame(&frame, grid);
+    phaseEnd(grid->timings, PHASE_FRAME, start, sizeof(Pos)*(frame.n_verts - n_grid) + sizeof(Face)*frame.n_faces, frame.n_verts - n_grid);
+    return frame;
+}
+static LithoMesh initLithoMesh(Image img, LithoOptions opts, Timings* timings) { // takes ownership of img's pixels, like makeLithoObj
+    LithoGrid grid = makeLithoGrid(&img, opts, timings);
+    Obj frame = makeLithoFrame(&grid);
+    transformObj(&frame, opts, timings);
+    return (LithoMesh){.grid = grid, .heights = NULL, .frame = frame, .flip_faces = (opts.flip_x + opts.flip_y + opts.flip_z) % 2};
+}
+static void fillHeightsTask(void* ctx, int task) { // a band of GRID_ROWS_PER_TASK rows
+    LithoMesh* mesh = (LithoMesh*)ctx;
+    const LithoGrid* grid = &mesh->grid;
+    int y_end = (task + 1)*GRID_ROWS_PER_TASK < grid->vheight ? (task + 1)*GRID_ROWS_PER_TASK : grid->vheight;
+    for (int y = task*GRID_ROWS_PER_TASK; y < y_end; y++) {
+        gridHeightRow(grid, 0, y, grid->vwidth, mesh->heights + (size_t)y*grid->vwidth);
     }
-    if (opts.flip_x) {
-        flipObjX(&obj);
+}
+static float* gridHeights(const LithoGrid* grid) { // every grid height, in row order
+    double start = phaseStart(grid->timings);
+    LithoMesh mesh = {.grid = *grid};
+    mesh.heights = (float*)malloc(sizeof(float)*grid->vwidth*grid->vheight);
+    int n_tasks = (grid->vheight + GRID_ROWS_PER_TASK - 1)/GRID_ROWS_PER_TASK;
+    parallelFor(n_tasks, resolveThreads(grid->opts.threads), fillHeightsTask, &mesh);
+    phaseEnd(grid->timings, PHASE_HEIGHTS, start, sizeof(float)*grid->vwidth*grid->vheight, (uint64_t)grid->vwidth*grid->vheight);
+    return mesh.heights;
+}
+static LithoMesh makeLithoMesh(Image img, LithoOptions opts, Timings* timings) {
+    LithoMesh mesh = initLithoMesh(img, opts, timings);
+    mesh.heights = gridHeights(&mesh.grid);
+    freeLithoGrid(&mesh.grid);
+    return mesh;
+}
+static LithoMesh makeLithoStream(Image img, LithoOptions opts, Timings* timings) {
+    return initLithoMesh(img, opts, timings);
+}
+static void freeLithoMesh(LithoMesh* mesh) {
+    freeLithoGrid(&mesh->grid);
+    free(mesh->heights);
+    free(mesh->frame.verts);
+    free(mesh->frame.faces);
+}
+
+static void lithoMeshGetVerts(void* ctx, int start, int count, Pos* out) {
+    const LithoMesh* mesh = (LithoMesh*)ctx;
+    const LithoGrid* grid = &mesh->grid;
+    int n_grid = grid->vwidth*grid->vheight;
+    float row[256];
+    int i = 0;
+    while (i < count) { // grid vertices go a piece of a row at a time
+        int v = start + i;
+        if (v >= n_grid) {
+            out[i++] = mesh->frame.verts[v - n_grid];
+            continue;
+        }
+        int x = v % grid->vwidth;
+        int y = v / grid->vwidth;
+        int n = grid->vwidth - x;
+        n = n < count - i ? n : count - i;
+        n = n < 256 ? n : 256;
+        const float* h = row;
+        if (mesh->heights) {
+            h = mesh->heights + v;
+        } else {
+            gridHeightRow(grid, x, y, n, row);
+        }
+        for (int k = 0; k < n; k++) {
+            out[i + k] = transformPos((Pos){.x = x + k, .y = h[k], .z = y}, grid->opts);
+        }
+        i += n;
     }
-    if (opts.flip_y) {
-        flipObjY(&obj);
+}
+static void lithoMeshGetFaces(void* ctx, int start, int count, Face* out) {
+    const LithoMesh* mesh = (LithoMesh*)ctx;
+    const int vwidth = mesh->grid.vwidth;
+    int n_grid_faces = 2*(vwidth - 1)*(mesh->grid.vheight - 1);
+    for (int i = 0; i < count; i++) {
+        int f = start + i;
+        if (f < n_grid_faces) { // same faces as the grid loop in makeLithoObj
+            int cell = f/2;
+            int v = (cell/(vwidth - 1) + 1)*vwidth + cell%(vwidth - 1) + 2; // 1-based index of the vertex at the cell's bottom right
+            if (f % 2 == 0) {
+                out[i] = (Face){.v1 = v, .v2 = v - vwidth, .v3 = v - vwidth - 1};
+            } else {
+                out[i] = (Face){.v1 = v, .v2 = v - vwidth - 1, .v3 = v - 1};
+            }
+            if (mesh->flip_faces) {
+                int temp = out[i].v2;
+                out[i].v2 = out[i].v3;
+                out[i].v3 = temp;
+            }
+        } else {
+            out[i] = mesh->frame.faces[f - n_grid_faces];
+        }
     }
-    if (opts.flip_z) {
-        flipObjZ(&obj);
+}
+static MeshSource lithoMeshSource(LithoMesh* mesh) {
+    return (MeshSource){
+        .n_verts = mesh->frame.n_verts,
+        .n_faces = 2*(mesh->grid.vwidth - 1)*(mesh->grid.vheight - 1) + mesh->frame.n_faces,
+        .ctx = mesh,
+        .getVerts = lithoMeshGetVerts,
+        .getFaces = lithoMeshGetFaces,
+    };
+}
+
+// A finished lithophane in whichever form the options call for: a full Obj when it gets simplified
+// (it isn't a regular heightfield anymore then), a LithoMesh otherwise.
+typedef struct {
+    LithoMesh mesh;
+    Obj obj;
+    int is_obj;
+    int borrowed; // the arrays belong to a LithoStages, see stagedLithophane
+} Lithophane;
+
+static Lithophane makeLithophane(Image img, LithoOptions opts, int stream, Timings* timings) { // takes ownership of img's pixels. timings may be NULL
+    Lithophane litho = {0};
+    litho.is_obj = opts.max_error > 0 || opts.max_faces > 0 || opts.simplify_error > 0;
+    if (litho.is_obj) {
+        litho.obj = makeLithoObj(img, opts, timings);
+    } else {
+        litho.mesh = stream ? makeLithoStream(img, opts, timings) : makeLithoMesh(img, opts, timings);
     }
+    return litho;
+}
+static MeshSource lithophaneSource(Lithophane* litho) {
+    return litho->is_obj ? objSource(&litho->obj) : lithoMeshSource(&litho->mesh);
+}
+static void freeLithophane(Lithophane* litho) {
+    if (!litho->borrowed) {
+        freeLithoMesh(&litho->mesh);
+        free(litho->obj.verts);
+        free(litho->obj.faces);
+    }
+    *litho = (Lithophane){0};
+}
 
-    stbi_image_free(brightness.img);
-    return obj;
+// a lithophane for opts from brightness sampled once for several sets of options (see --sweep).
+// sampled isn't changed, and it has to outlast the result. free the result with freeSharedGridLithophane
+static Lithophane sharedGridLithophane(const LithoGrid* sampled, LithoOptions opts) {
+    LithoGrid grid = *sampled;
+    grid.opts = opts;
+    grid.height_lut = NULL;
+    grid.index_map = NULL;
+    buildHeightLut(&grid);
+    Lithophane litho = {.is_obj = opts.max_error > 0 || opts.max_faces > 0 || opts.simplify_error > 0};
+    if (litho.is_obj) {
+        litho.obj = buildLithoObj(&grid);
+        free(grid.height_lut);
+    } else {
+        Obj frame = makeLithoFrame(&grid);
+        transformObj(&frame, opts, grid.timings);
+        litho.mesh = (LithoMesh){.grid = grid, .heights = gridHeights(&grid), .frame = frame, .flip_faces = (opts.flip_x + opts.flip_y + opts.flip_z) % 2};
+    }
+    return litho;
+}
+static void freeSharedGridLithophane(Lithophane* litho) { // everything but the sampled brightness
+    free(litho->mesh.grid.height_lut);
+    free(litho->mesh.heights);
+    free(litho->mesh.frame.verts);
+    free(litho->mesh.frame.faces);
+    free(litho->obj.verts);
+    free(litho->obj.faces);
+    *litho = (Lithophane){0};
+}
+
+// One image made into lithophanes over and over with different options, like when tuning them.
+// The work is split into stages, each kept until an option it depends on changes, which remakes
+// it and every stage after it:
+//   grid     the brightness at each vertex, and its statistics: pixels_per_vertex, filter
+//   heights  the brightness to height table, and the grid heights: curve, curve_param, the csv curve, bright_scale, min_thickness
+//   frame    the frame and backside: has_frame, bevel_corners, frame_thickness, frame_angle, frame_width
+//   placed   the frame after scale and flips
+// The decoded image comes first and never changes. Grid vertices are only placed (scaled and
+// flipped) as they're read, so changing only the frame or the transforms costs next to nothing.
+// A simplified mesh is one more stage after heights, remade for any other change, since simplifying
+// works on the whole mesh.
+typedef struct {
+    Image image;
+    LithoGrid grid; // no brightness until sampled
+    float* heights; // NULL while the last mesh was simplified
+    Obj frame;
+    Obj placed;
+    Obj obj; // simplified meshes
+    LithoOptions built; // what the stages were made with. curve_points is a copy of its own
+} LithoStages;
+
+static LithoStages initLithoStages(Image img) { // takes ownership of img's pixels
+    return (LithoStages){.image = img};
+}
+static void freeObjArrays(Obj* obj) {
+    free(obj->verts);
+    free(obj->faces);
+    *obj = (Obj){0};
 }
-Obj makeDefaultLithoObj(Image img) {
-  return makeLithoObj(img, defaultLithoOptions());
+static void freeLithoStages(LithoStages* stages) {
+    freeImage(&stages->image);
+    freeLithoGrid(&stages->grid);
+    free(stages->heights);
+    freeObjArrays(&stages->frame);
+    freeObjArrays(&stages->placed);
+    freeObjArrays(&stages->obj);
+    free(stages->built.curve_points);
+    *stages = (LithoStages){0};
 }
 
-void saveObj(Obj obj, const char* filename, int argc, char* argv[]) {
-    FILE *f = fopen(filename, "w");
-    fprintf(f, "# Lithophane obj file made using https://github.com/ekhadley/litho\n");
-    fprintf(f, "# Generated with command:");
-    for (int i = 0; i < argc; i++) {
-        fprintf(f, " %s", argv[i]);
+static int sameSampling(const LithoOptions* a, const LithoOptions* b) {
+    return a->pixels_per_vertex == b->pixels_per_vertex && a->filter == b->filter;
+}
+static int sameHeights(const LithoOptions* a, const LithoOptions* b) {
+    return a->curve == b->curve && a->curve_param == b->curve_param && a->n_curve_points == b->n_curve_points
+        && (a->n_curve_points == 0 || memcmp(a->curve_points, b->curve_points, sizeof(float)*2*a->n_curve_points) == 0)
+        && a->bright_scale == b->bright_scale && a->min_thickness == b->min_thickness;
+}
+static int sameFrame(const LithoOptions* a, const LithoOptions* b) {
+    return a->has_frame == b->has_frame && a->bevel_corners == b->bevel_corners && a->frame_thickness == b->frame_thickness
+        && a->frame_angle == b->frame_angle && a->frame_width == b->frame_width;
+}
+static int samePlacement(const LithoOptions* a, const LithoOptions* b) {
+    return a->scale == b->scale && a->flip_x == b->flip_x && a->flip_y == b->flip_y && a->flip_z == b->flip_z;
+}
+static int sameSimplifying(const LithoOptions* a, const LithoOptions* b) {
+    return a->max_error == b->max_error && a->max_faces == b->max_faces && a->simplify_error == b->simplify_error;
+}
+
+// the lithophane for opts, remaking only the stages whose options changed. It's the same mesh
+// makeLithophane would give, but its arrays stay with stages: it lasts until the next call or
+// freeLithoStages (freeLithophane on it is fine, and frees nothing)
+static Lithophane stagedLithophane(LithoStages* stages, LithoOptions opts) {
+    const LithoOptions* built = &stages->built;
+    int stale = !stages->grid.brightness.img || !sameSampling(built, &opts);
+    if (stale) {
+        freeLithoGrid(&stages->grid);
+        stages->grid = sampleLithoGrid(stages->image, opts, NULL);
     }
-    fprintf(f, "\n");
-    fprintf(f, "o litho\n");
-    for (int i = 0; i < obj.n_verts; i++) {
-        fprintf(f, "v %f %f %f\n", obj.verts[i].x, obj.verts[i].y, obj.verts[i].z);
+    stages->grid.opts = opts;
+    stale = stale || !sameHeights(built, &opts);
+    if (stale) {
+        buildHeightLut(&stages->grid);
     }
-    fprintf(f, "g faces\n");
-    for (int i = 0; i < obj.n_faces; i++) {
-        fprintf(f, "f %d %d %d\n", obj.faces[i].v1, obj.faces[i].v2, obj.faces[i].v3);
+
+    Lithophane litho = {.is_obj = opts.max_error > 0 || opts.max_faces > 0 || opts.simplify_error > 0, .borrowed = 1};
+    if (litho.is_obj) {
+        free(stages->heights);
+        stages->heights = NULL;
+        freeObjArrays(&stages->frame);
+        freeObjArrays(&stages->placed);
+        if (stale || !stages->obj.verts || !sameFrame(built, &opts) || !samePlacement(built, &opts) || !sameSimplifying(built, &opts)) {
+            freeObjArrays(&stages->obj);
+            stages->obj = buildLithoObj(&stages->grid);
+        }
+        litho.obj = stages->obj;
+    } else {
+        freeObjArrays(&stages->obj);
+        if (stale || !stages->heights) {
+            free(stages->heights);
+            stages->heights = gridHeights(&stages->grid);
+        }
+        stale = stale || !stages->frame.verts || !sameFrame(built, &opts);
+        if (stale) {
+            freeObjArrays(&stages->frame);
+            stages->frame = makeLithoFrame(&stages->grid);
+        }
+        if (stale || !stages->placed.verts || !samePlacement(built, &opts)) {
+            Obj placed = stages->frame;
+            int n = placed.n_verts - placed.first_vert;
+            placed.verts = (Pos*)malloc(sizeof(Pos)*(n > 0 ? n : 1));
+            placed.faces = (Face*)malloc(sizeof(Face)*(placed.n_faces > 0 ? placed.n_faces : 1));
+            memcpy(placed.verts, stages->frame.verts, sizeof(Pos)*n);
+            memcpy(placed.faces, stages->frame.faces, sizeof(Face)*placed.n_faces);
+            placed.max_verts = n;
+            placed.max_faces = placed.n_faces;
+            transformObj(&placed, opts, NULL);
+            freeObjArrays(&stages->placed);
+            stages->placed = placed;
+        }
+        litho.mesh = (LithoMesh){
+            .grid = stages->grid, .heights = stages->heights, .frame = stages->placed,
+            .flip_faces = (opts.flip_x + opts.flip_y + opts.flip_z) % 2,
+        };
     }
-    fclose(f);
+
+    float* points = NULL;
+    if (opts.n_curve_points > 0) {
+        points = (float*)malloc(sizeof(float)*2*opts.n_curve_points);
+        memcpy(points, opts.curve_points, sizeof(float)*2*opts.n_curve_points);
+    }
+    free(stages->built.curve_points);
+    stages->built = opts;
+    stages->built.curve_points = points;
+    stages->grid.opts.curve_points = points; // opts' own copy can go away before the next call
+    return litho;
 }
@@ -1,84 +1,657 @@
 #define STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_WRITE_IMPLEMENTATION
+#define STB_IMAGE_STATIC // private to liblitho, so they can't clash with a program's own copy of stb
+#define STB_IMAGE_WRITE_STATIC
+#ifdef __GNUC__
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function" // only some of stb is used
+#endif
 #include "../include/stb_image.h"
 #include "../include/stb_image_write.h"
+#ifdef __GNUC__
+#pragma GCC diagnostic pop
+#endif
+#include "../include/litho.h"
+#include <ctype.h>
+#include <limits.h>
+#include "simd.c"
+#include "threads.c"
+#include "timing.c"
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
 
 typedef struct {
     int width;
     int height;
     int channels;
-    unsigned char* img;
+    unsigned char* img; // the values are the size type says, img is cast for the wider ones
+    LithoPixelType type;
+    void* mapped; // set when img points into a memory mapped file instead of its own allocation
+    size_t mapped_size;
 } Image;
 
-Image loadInputImage(const char* filename) {
-    int width, height, channels;
-    unsigned char* img = stbi_load(filename, &width, &height, &channels, 0);
-    return (Image){.width = width, .height = height, .channels = channels, .img = img};
+static inline size_t pixelTypeSize(LithoPixelType type) { // bytes per channel value
+    return type == LITHO_PIXELS_F32 ? 4 : type == LITHO_PIXELS_U16 ? 2 : 1;
 }
-void savePng(const char* filename, Image img) {
-    stbi_write_png(filename, img.width, img.height, img.channels, img.img, img.width*img.channels);
+
+static void freeImage(Image* img) {
+#ifndef _WIN32
+    if (img->mapped) {
+        munmap(img->mapped, img->mapped_size);
+        img->mapped = NULL;
+        img->img = NULL;
+        return;
+    }
+#endif
+    stbi_image_free(img->img);
+    img->img = NULL;
 }
 
-float RGBbrightness(int r, int g, int b) { // apparent brightness formula for the human eye
-    return 0.299*r + 0.587*g + 0.114*b;
+// The input file is memory mapped (read whole on windows) and decoded from memory. Binary pgm, ppm
+// and pfm files are already laid out (nearly) like a decoded image, so those are used straight from
+// the mapping without decoding or copying. 16 bit and float files only need their bytes put in order.
+typedef struct {
+    unsigned char* data;
+    size_t size;
+    int mapped;
+} FileData;
+
+static FileData readFileData(const char* filename) {
+    FileData file = {0};
+#ifndef _WIN32
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return file;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        // private, so cropping in place later writes to our own copy of those pages, not the file
+        void* data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            file = (FileData){.data = (unsigned char*)data, .size = st.st_size, .mapped = 1};
+        }
+    }
+    close(fd);
+#else
+    FILE* f = fopen(filename, "rb");
+    if (!f) {
+        return file;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (size > 0) {
+        file.data = (unsigned char*)malloc(size);
+        file.size = fread(file.data, 1, size, f);
+    }
+    fclose(f);
+#endif
+    return file;
 }
-float brightnessAt(Image img, int x, int y) {
-    int idx = (y*img.width + x)*img.channels;
-    return RGBbrightness(img.img[idx], img.img[idx+1], img.img[idx+2]);
+static void freeFileData(FileData* file) {
+#ifndef _WIN32
+    if (file->mapped) {
+        munmap(file->data, file->size);
+        file->data = NULL;
+        return;
+    }
+#endif
+    free(file->data);
+    file->data = NULL;
 }
 
-void printPixel(Image img, int x, int y) {
-    int idx = ((img.width*y) + x)*img.channels;
-    if (idx < img.height*img.width*img.channels) {
-        if (img.channels == 3) {
-            printf("[%d, %d, %d] (%f)\n", img.img[idx], img.img[idx+1], img.img[idx+2], RGBbrightness(img.img[idx], img.img[idx+1], img.img[idx+2]));
-            return;
+static int readPnmNumber(const unsigned char* data, size_t size, size_t* pos) { // skips whitespace and comments. -1 if there's no number
+    while (*pos < size) {
+        if (data[*pos] == '#') {
+            while (*pos < size && data[*pos] != '\n') {
+                (*pos)++;
+            }
+        } else if (isspace(data[*pos])) {
+            (*pos)++;
         } else {
-            printf("\n[");
-            for (int i = 0; i < img.channels-1; i++) {
-                printf("%d, ", img.img[idx+i]);
+            break;
+        }
+    }
+    if (*pos >= size || !isdigit(data[*pos])) {
+        return -1;
+    }
+    long v = 0;
+    while (*pos < size && isdigit(data[*pos]) && v < INT_MAX/10) {
+        v = v*10 + (data[(*pos)++] - '0');
+    }
+    return v;
+}
+static int hostIsLittleEndian() {
+    const uint16_t probe = 1;
+    return *(const unsigned char*)&probe;
+}
+// where the pixels of a raw file start off at pos are used from. wide values have to start on a
+// multiple of their size, and the mapping starts on a page boundary, so they're moved back over the
+// header, which is no longer needed, as far as that takes. a file read into memory instead has its
+// pixels moved right to the start, so the buffer can be freed like any decoded image.
+static unsigned char* placePixels(const FileData* file, size_t pos, size_t n_bytes, size_t align) {
+    size_t to = file->mapped ? pos/align*align : 0;
+    if (to != pos) {
+        memmove(file->data + to, file->data + pos, n_bytes);
+    }
+    return file->data + to;
+}
+
+// points img into the file's memory if it's a binary pgm (P5) or ppm (P6) with 8 or 16 bit values. 16 bit
+// values are big endian in the file, so they're swapped (and stretched to 0..65535 if maxval is
+// lower) in place. returns 0 for anything else
+static int rawPnmImage(const FileData* file, Image* img) {
+    if (file->size < 3 || file->data[0] != 'P' || (file->data[1] != '5' && file->data[1] != '6')) {
+        return 0;
+    }
+    size_t pos = 2;
+    int width = readPnmNumber(file->data, file->size, &pos);
+    int height = readPnmNumber(file->data, file->size, &pos);
+    int maxval = readPnmNumber(file->data, file->size, &pos);
+    int channels = file->data[1] == '5' ? 1 : 3;
+    pos++; // the single whitespace after maxval
+    LithoPixelType type = maxval > 255 ? LITHO_PIXELS_U16 : LITHO_PIXELS_U8;
+    size_t n_values = (size_t)width*height*channels;
+    if (width <= 0 || height <= 0 || (maxval != 255 && (maxval < 256 || maxval > 65535)) || pos + n_values*pixelTypeSize(type) > file->size) {
+        return 0;
+    }
+    unsigned char* pixels = placePixels(file, pos, n_values*pixelTypeSize(type), pixelTypeSize(type));
+    if (type == LITHO_PIXELS_U16) {
+        uint16_t* v = (uint16_t*)pixels;
+        for (size_t i = 0; i < n_values; i++) {
+            const unsigned char* b = pixels + 2*i;
+            uint32_t x = (b[0] << 8) | b[1];
+            v[i] = maxval == 65535 ? x : (x >= (uint32_t)maxval ? 65535 : (x*65535 + maxval/2)/maxval);
+        }
+    }
+    *img = (Image){.width = width, .height = height, .channels = channels, .img = pixels, .type = type, .mapped = file->mapped ? file->data : NULL, .mapped_size = file->size};
+    return 1;
+}
+
+// same for a pfm float image, "Pf" (grey) or "PF" (rgb). the sign of the scale line gives the byte
+// order (negative is little endian), and rows are stored bottom to top, so both are put right in place
+static int rawPfmImage(const FileData* file, Image* img) {
+    if (file->size < 3 || file->data[0] != 'P' || (file->data[1] != 'f' && file->data[1] != 'F')) {
+        return 0;
+    }
+    size_t pos = 2;
+    int width = readPnmNumber(file->data, file->size, &pos);
+    int height = readPnmNumber(file->data, file->size, &pos);
+    while (pos < file->size && isspace(file->data[pos])) {
+        pos++;
+    }
+    int little_endian = pos < file->size && file->data[pos] == '-';
+    while (pos < file->size && !isspace(file->data[pos])) { // only the sign of the scale matters
+        pos++;
+    }
+    pos++;
+    int channels = file->data[1] == 'f' ? 1 : 3;
+    size_t row_bytes = (size_t)width*channels*4;
+    if (width <= 0 || height <= 0 || pos + row_bytes*height > file->size) {
+        return 0;
+    }
+    unsigned char* pixels = placePixels(file, pos, row_bytes*height, 4);
+    if (little_endian != hostIsLittleEndian()) {
+        for (size_t i = 0; i < row_bytes*height; i += 4) {
+            unsigned char* b = pixels + i;
+            unsigned char t0 = b[0], t1 = b[1];
+            b[0] = b[3];
+            b[1] = b[2];
+            b[2] = t1;
+            b[3] = t0;
+        }
+    }
+    unsigned char* temp = (unsigned char*)malloc(row_bytes);
+    for (int y = 0; y < height/2; y++) {
+        unsigned char* top = pixels + (size_t)y*row_bytes;
+        unsigned char* bottom = pixels + (size_t)(height - 1 - y)*row_bytes;
+        memcpy(temp, top, row_bytes);
+        memcpy(top, bottom, row_bytes);
+        memcpy(bottom, temp, row_bytes);
+    }
+    free(temp);
+    *img = (Image){.width = width, .height = height, .channels = channels, .img = pixels, .type = LITHO_PIXELS_F32, .mapped = file->mapped ? file->data : NULL, .mapped_size = file->size};
+    return 1;
+}
+
+LithoLoadOptions lithoDefaultLoadOptions() {
+    return (LithoLoadOptions){.crop_x = 0, .crop_y = 0, .crop_width = 0, .crop_height = 0, .scale = 1};
+}
+
+// Crops and shrinks a decoded image in place, then gives the memory it no longer needs back.
+// Each output pixel is written at or before the first input byte its block reads, so nothing is
+// overwritten before it's used.
+static void cropAndScale(Image* img, LithoLoadOptions load) {
+    int x0 = load.crop_x > 0 ? load.crop_x : 0;
+    int y0 = load.crop_y > 0 ? load.crop_y : 0;
+    int w = load.crop_width > 0 ? load.crop_width : img->width - x0;
+    int h = load.crop_height > 0 ? load.crop_height : img->height - y0;
+    w = x0 + w > img->width ? img->width - x0 : w;
+    h = y0 + h > img->height ? img->height - y0 : h;
+    int s = load.scale > 1 ? load.scale : 1;
+    int out_w = w > 0 ? w/s : 0, out_h = h > 0 ? h/s : 0;
+    if (out_w <= 0 || out_h <= 0) {
+        freeImage(img);
+        *img = (Image){0};
+        return;
+    }
+    if (x0 == 0 && y0 == 0 && out_w == img->width && out_h == img->height) {
+        return;
+    }
+    const int c = img->channels;
+    const size_t size = pixelTypeSize(img->type);
+    const size_t row_bytes = (size_t)img->width*c*size;
+    unsigned char* dst = img->img;
+    for (int oy = 0; oy < out_h; oy++) {
+        const unsigned char* src = img->img + (size_t)(y0 + oy*s)*row_bytes + (size_t)x0*c*size;
+        if (s == 1) {
+            memmove(dst, src, (size_t)out_w*c*size);
+            dst += (size_t)out_w*c*size;
+            continue;
+        }
+        for (int ox = 0; ox < out_w; ox++) {
+            for (int k = 0; k < c; k++) {
+                if (img->type == LITHO_PIXELS_U8) {
+                    int sum = 0;
+                    for (int dy = 0; dy < s; dy++) {
+                        const unsigned char* p = src + dy*row_bytes + (size_t)ox*s*c + k;
+                        for (int dx = 0; dx < s; dx++) {
+                            sum += p[dx*c];
+                        }
+                    }
+                    *dst++ = (sum + s*s/2)/(s*s);
+                    continue;
+                }
+                double sum = 0;
+                for (int dy = 0; dy < s; dy++) {
+                    const unsigned char* p = src + dy*row_bytes + ((size_t)ox*s*c + k)*size;
+                    for (int dx = 0; dx < s; dx++) {
+                        sum += img->type == LITHO_PIXELS_U16 ? ((const uint16_t*)p)[dx*c] : ((const float*)p)[dx*c];
+                    }
+                }
+                if (img->type == LITHO_PIXELS_U16) {
+                    *(uint16_t*)dst = (uint16_t)(sum/(s*s) + 0.5);
+                } else {
+                    *(float*)dst = sum/(s*s);
+                }
+                dst += size;
             }
-            printf("%d]", img.img[idx+img.channels-1]);
         }
+    }
+    img->width = out_w;
+    img->height = out_h;
+    if (!img->mapped) {
+        unsigned char* shrunk = (unsigned char*)STBI_REALLOC(img->img, (size_t)out_w*out_h*c*size);
+        img->img = shrunk ? shrunk : img->img;
+    }
+}
+
+// stb_image can't decode part of an image or decode jpegs at a lower resolution, so the whole
+// image is decoded and then cropped and shrunk in place right away, before anything else touches it.
+// 16 bit and hdr images are decoded at their full depth rather than cut down to 8 bits.
+static Image decodeFileData(FileData file, LithoLoadOptions load) { // takes ownership of file's memory
+    Image img = {0};
+    if (rawPnmImage(&file, &img) || rawPfmImage(&file, &img)) { // the file's memory now belongs to img
+        cropAndScale(&img, load);
+        return img;
+    }
+    int width = 0, height = 0, channels = 0;
+    unsigned char* pixels;
+    LithoPixelType type = LITHO_PIXELS_U8;
+    if (stbi_is_16_bit_from_memory(file.data, file.size)) {
+        pixels = (unsigned char*)stbi_load_16_from_memory(file.data, file.size, &width, &height, &channels, 0);
+        type = LITHO_PIXELS_U16;
+    } else if (stbi_is_hdr_from_memory(file.data, file.size)) {
+        pixels = (unsigned char*)stbi_loadf_from_memory(file.data, file.size, &width, &height, &channels, 0);
+        type = LITHO_PIXELS_F32;
     } else {
-        printf("\ncoord [%d, %d] is not valid for image of shape: (%d, %d, %d)", x, y, img.height, img.width, img.channels);
+        pixels = stbi_load_from_memory(file.data, file.size, &width, &height, &channels, 0);
+    }
+    freeFileData(&file);
+    img = (Image){.width = width, .height = height, .channels = channels, .img = pixels, .type = type};
+    if (img.img) {
+        cropAndScale(&img, load);
+    }
+    return img;
+}
+static Image loadInputImage(const char* filename, LithoLoadOptions load, Timings* timings) { // timings may be NULL
+    double start = phaseStart(timings);
+    FileData file = readFileData(filename);
+    if (!file.data) {
+        return (Image){0};
+    }
+    Image img = decodeFileData(file, load);
+    phaseEnd(timings, PHASE_LOAD, start, (uint64_t)img.width*img.height*img.channels*pixelTypeSize(img.type), 0);
+    return img;
+}
+// same for an image file that's already in memory. takes ownership of data, which has to come from malloc
+static Image loadImageFromMemory(unsigned char* data, size_t size, LithoLoadOptions load) {
+    if (!data || size == 0) {
+        free(data);
+        return (Image){0};
+    }
+    return decodeFileData((FileData){.data = data, .size = size, .mapped = 0}, load);
+}
+
+static float RGBbrightness(int r, int g, int b) { // apparent brightness formula for the human eye
+    return 0.299*r + 0.587*g + 0.114*b;
+}
+
+
+static void brightnessRow(const unsigned char* px, int channels, int n, unsigned char* out) { // floor(RGBbrightness) of n pixels
+    if (channels >= 3) { // rgb or rgba
+        lumaRow(px, channels, n, out);
+    } else { // grey, maybe with alpha
+        for (int i = 0; i < n; i++) {
+            int v = px[i*channels];
+            out[i] = floor(RGBbrightness(v, v, v));
+        }
+    }
+}
+static inline double wideValue(const unsigned char* px, LithoPixelType type, size_t i) { // channel value i as 0 to 65535
+    if (type == LITHO_PIXELS_U16) {
+        return ((const uint16_t*)px)[i];
+    }
+    float f = ((const float*)px)[i];
+    return (f > 0 ? (f < 1 ? f : 1) : 0)*65535.0; // nan ends up 0 too
+}
+// brightness levels (0 to 65535) of n 16 bit or float pixels. rounded, there's no old output to stay floored for
+static void wideBrightnessRow(const unsigned char* px, LithoPixelType type, int channels, int n, uint16_t* out) {
+    if (type == LITHO_PIXELS_U16 && channels == 1) {
+        memcpy(out, px, sizeof(uint16_t)*n);
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        size_t p = (size_t)i*channels;
+        double v = channels >= 3 ? 0.299*wideValue(px, type, p) + 0.587*wideValue(px, type, p + 1) + 0.114*wideValue(px, type, p + 2) : wideValue(px, type, p);
+        out[i] = (uint16_t)(v + 0.5);
     }
 }
 
-Image rgbToBrightness(Image img) {
-    Image brightness = {.width=img.width, .height=img.height, .channels=1, .img=NULL};
-    brightness.img = (unsigned char*)malloc(img.height*img.width);
-    for (int i = 0; i < img.height*img.width; i++) {
-        brightness.img[i] = floor(RGBbrightness(img.img[i*3], img.img[i*3 + 1], img.img[i*3 + 2]));
+// Pixel statistics come from a histogram of one channel, counted in a single pass over the image
+// (split over threads, each with its own histogram, merged at the end). Mean, variance
+// and max are then all worked out from the 256 bins, and come out in the usual 0 to 255 brightness.
+// Nothing needs the min or percentiles yet. They'd be the same kind of walk over histogramBins.
+// 16 bit brightness gets 65536 bins instead, too many to keep a histogram per task until the end.
+// Each task counts its rows into a temporary table of its own, then adds the bins it used into the
+// one shared histogram with atomic adds (see countWideHistogram).
+#define WIDE_LEVELS 65536
+
+typedef struct {
+    uint64_t counts[256];
+    uint64_t total;
+    uint64_t* wide_counts; // WIDE_LEVELS bins used instead of counts for 16 bit brightness. NULL for 8 bit
+} Histogram;
+
+static void freeHistogram(Histogram* hist) {
+    free(hist->wide_counts);
+    hist->wide_counts = NULL;
+}
+// counts n levels into a temporary table, then adds its nonzero bins into hist. safe to call from several tasks at once
+static void countWideHistogram(Histogram* hist, const uint16_t* levels, size_t n) {
+    uint32_t* counts = (uint32_t*)calloc(WIDE_LEVELS, sizeof(uint32_t));
+    for (size_t i = 0; i < n; i++) {
+        counts[levels[i]]++;
+    }
+    for (int v = 0; v < WIDE_LEVELS; v++) {
+        if (counts[v]) {
+            atomicAdd(&hist->wide_counts[v], counts[v]);
+        }
+    }
+    atomicAdd(&hist->total, n);
+    free(counts);
+}
+static const uint64_t* histogramBins(const Histogram* hist, int* n_bins, double* unit) { // unit is the brightness of one bin
+    *n_bins = hist->wide_counts ? WIDE_LEVELS : 256;
+    *unit = hist->wide_counts ? 255.0/(WIDE_LEVELS - 1) : 1;
+    return hist->wide_counts ? hist->wide_counts : hist->counts;
+}
+
+static void countHistogram(Histogram* hist, const unsigned char* px, int stride, size_t n) { // adds n values, stride bytes apart
+    uint32_t counts[4][256] = {{0}}; // spread over 4 tables so runs of the same value don't wait on each other
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        counts[0][px[i*stride]]++;
+        counts[1][px[(i + 1)*stride]]++;
+        counts[2][px[(i + 2)*stride]]++;
+        counts[3][px[(i + 3)*stride]]++;
+    }
+    for (; i < n; i++) {
+        counts[0][px[i*stride]]++;
+    }
+    for (int v = 0; v < 256; v++) {
+        hist->counts[v] += (uint64_t)counts[0][v] + counts[1][v] + counts[2][v] + counts[3][v];
+    }
+    hist->total += n;
+}
+
+static Histogram mergeHistograms(const Histogram* parts, int n) {
+    Histogram hist = {0};
+    for (int t = 0; t < n; t++) {
+        for (int v = 0; v < 256; v++) {
+            hist.counts[v] += parts[t].counts[v];
+        }
+        hist.total += parts[t].total;
+    }
+    return hist;
+}
+
+
+
+static double histogramMean(const Histogram* hist) {
+    int n;
+    double unit;
+    const uint64_t* counts = histogramBins(hist, &n, &unit);
+    double sum = 0;
+    for (int v = 0; v < n; v++) {
+        sum += (double)v*counts[v];
+    }
+    return hist->total ? sum/hist->total*unit : 0;
+}
+static double histogramVar(const Histogram* hist, double mean) {
+    int n;
+    double unit;
+    const uint64_t* counts = histogramBins(hist, &n, &unit);
+    double sum = 0;
+    for (int v = 0; v < n; v++) {
+        sum += (v*unit - mean)*(v*unit - mean)*counts[v];
     }
-    return brightness;
+    return hist->total ? sum/hist->total : 0;
 }
+static double histogramMax(const Histogram* hist) {
+    int n;
+    double unit;
+    const uint64_t* counts = histogramBins(hist, &n, &unit);
+    for (int v = n - 1; v >= 0; v--) {
+        if (counts[v]) {
+            return v*unit;
+        }
+    }
+    return 0;
+}
+
+// Brightness reduced to one value per step x step block of pixels, as an image of
+// (width/step, height/step), plus the brightness histogram of every pixel, in one pass over the
+// colour image. The full size brightness image never exists: each band of output rows converts
+// just the input rows it needs, counts them, filters them, and drops them.
+// Output pixel (x, y) sits on input pixel (x*step, y*step). The point filter just takes that pixel,
+// the others weigh the pixels around it with a separable kernel, stretched by step:
+// box averages the step x step block around it, triangle blends over twice that, and lanczos (a = 3) is sharpest.
+// 16 bit and float images give 16 bit brightness levels (LITHO_PIXELS_U16) all the way through, 8 bit ones 0 to 255.
+#define SAMPLE_ROWS_PER_TASK 32 // output rows
 
-float getPixelMean(const Image img, const int channel) { // gives mean of pixels on a particular channel
-    float mean = 0.0;
-    for (int i = channel; i < (img.height*img.width); i += img.channels) {
-        mean += img.img[i];
+typedef struct { // the input pixels and weights making up each output pixel along one axis
+    int* start;
+    int* count;
+    float* weights; // max_taps per output pixel
+    int max_taps;
+} FilterTaps;
+
+static double filterKernel(LithoFilter filter, double t) {
+    t = fabs(t);
+    switch (filter) {
+        case LITHO_FILTER_BOX:
+            return t < 0.5 ? 1 : t == 0.5 ? 0.5 : 0;
+        case LITHO_FILTER_TRIANGLE:
+            return t < 1 ? 1 - t : 0;
+        case LITHO_FILTER_LANCZOS:
+            if (t == 0) {
+                return 1;
+            }
+            return t < 3 ? 3*sin(M_PI*t)*sin(M_PI*t/3)/(M_PI*M_PI*t*t) : 0;
+        default:
+            return t == 0;
     }
-    return mean/(img.height*img.width);
 }
-float getPixelVar(const Image img, const float mean, const int channel) { // gives mean of pixels on a particular channel
-    float var = 0.0;
-    for (int i = channel; i < (img.height*img.width); i += img.channels) {
-        var += pow(img.img[i] - mean, 2);
+static FilterTaps makeFilterTaps(LithoFilter filter, int step, int n_out, int n_in) {
+    double radius = filter == LITHO_FILTER_BOX ? 0.5 : filter == LITHO_FILTER_TRIANGLE ? 1 : filter == LITHO_FILTER_LANCZOS ? 3 : 0;
+    FilterTaps taps = {.max_taps = (int)(2*radius*step) + 1};
+    taps.start = (int*)malloc(sizeof(int)*n_out);
+    taps.count = (int*)malloc(sizeof(int)*n_out);
+    taps.weights = (float*)malloc(sizeof(float)*n_out*taps.max_taps);
+    for (int o = 0; o < n_out; o++) {
+        int center = o*step;
+        int first = center - (int)(radius*step), last = center + (int)(radius*step);
+        first = first < 0 ? 0 : first; // pixels past the edge are left out and the rest scaled up
+        last = last > n_in - 1 ? n_in - 1 : last;
+        float* w = taps.weights + o*taps.max_taps;
+        double sum = 0;
+        for (int i = first; i <= last; i++) {
+            w[i - first] = filterKernel(filter, (i - center)/(double)step);
+            sum += w[i - first];
+        }
+        for (int i = first; i <= last; i++) {
+            w[i - first] /= sum;
+        }
+        taps.start[o] = first;
+        taps.count[o] = last - first + 1;
     }
-    return var/(img.height*img.width);
+    return taps;
 }
-typedef struct {float min; float max;} MinMax;
-MinMax getPixelMinMax(const Image img, const int channel) { // gives mean of pixels on a particular channel
-    float min = img.img[channel];
-    float max = img.img[channel];
-    for (int i = channel; i < (img.height*img.width); i += img.channels) {
-        if (img.img[i] < min) {
-            min = img.img[i];
+static void freeFilterTaps(FilterTaps* taps) {
+    free(taps->start);
+    free(taps->count);
+    free(taps->weights);
+}
+
+typedef struct {
+    const Image* img;
+    int step;
+    LithoFilter filter;
+    FilterTaps x_taps;
+    FilterTaps y_taps;
+    Image* out;
+    Histogram* partial; // one per task, for 8 bit brightness
+    Histogram* hist; // shared by the tasks, for 16 bit brightness
+} SampleJob;
+
+static void sampleBrightnessTask(void* ctx, int task) {
+    SampleJob* job = (SampleJob*)ctx;
+    const Image* img = job->img;
+    const int w = img->width, step = job->step;
+    const int wide = img->type != LITHO_PIXELS_U8; // rows and output are 16 bit levels
+    const size_t level_size = wide ? 2 : 1;
+    int o_start = task*SAMPLE_ROWS_PER_TASK;
+    int o_end = o_start + SAMPLE_ROWS_PER_TASK < job->out->height ? o_start + SAMPLE_ROWS_PER_TASK : job->out->height;
+    // every input row is counted by exactly one task, the rows its output rows start on (and for the last task, the rest)
+    int own_start = o_start*step;
+    int own_end = o_end == job->out->height ? img->height : o_end*step;
+    int in_start = own_start, in_end = own_end; // rows to convert, which can reach into the neighbouring bands
+    if (job->filter != LITHO_FILTER_POINT && o_end > o_start) {
+        int lo = job->y_taps.start[o_start];
+        int hi = job->y_taps.start[o_end - 1] + job->y_taps.count[o_end - 1];
+        in_start = lo < in_start ? lo : in_start;
+        in_end = hi > in_end ? hi : in_end;
+    }
+    const size_t in_row_bytes = (size_t)w*img->channels*pixelTypeSize(img->type);
+    unsigned char* rows = (unsigned char*)malloc((size_t)(in_end - in_start)*w*level_size);
+    for (int y = in_start; y < in_end; y++) {
+        unsigned char* row = rows + (size_t)(y - in_start)*w*level_size;
+        if (wide) {
+            wideBrightnessRow(img->img + (size_t)y*in_row_bytes, img->type, img->channels, w, (uint16_t*)row);
+        } else {
+            brightnessRow(img->img + (size_t)y*in_row_bytes, img->channels, w, row);
         }
-        if (img.img[i] > max) {
-            max = img.img[i];
+    }
+    if (wide && own_end > own_start) {
+        countWideHistogram(job->hist, (const uint16_t*)(rows + (size_t)(own_start - in_start)*w*level_size), (size_t)(own_end - own_start)*w);
+    } else if (!wide) {
+        countHistogram(&job->partial[task], rows + (size_t)(own_start - in_start)*w, 1, (size_t)(own_end - own_start)*w);
+    }
+
+    float* column_sums = job->filter != LITHO_FILTER_POINT ? (float*)malloc(sizeof(float)*w) : NULL;
+    for (int oy = o_start; oy < o_end; oy++) {
+        unsigned char* dst = job->out->img + (size_t)oy*job->out->width*level_size;
+        if (job->filter == LITHO_FILTER_POINT) {
+            const unsigned char* row = rows + (size_t)(oy*step - in_start)*w*level_size;
+            for (int x = 0; x < job->out->width; x++) {
+                if (wide) {
+                    ((uint16_t*)dst)[x] = ((const uint16_t*)row)[x*step];
+                } else {
+                    dst[x] = row[x*step];
+                }
+            }
+            continue;
+        }
+        // down the columns first, over whole rows so it vectorizes, then along the row
+        memset(column_sums, 0, sizeof(float)*w);
+        const float* wy = job->y_taps.weights + oy*job->y_taps.max_taps;
+        for (int k = 0; k < job->y_taps.count[oy]; k++) {
+            const unsigned char* row = rows + (size_t)(job->y_taps.start[oy] + k - in_start)*w*level_size;
+            if (wide) {
+                addWeightedRow16(column_sums, (const uint16_t*)row, wy[k], w);
+            } else {
+                addWeightedRow(column_sums, row, wy[k], w);
+            }
+        }
+        const float max_level = wide ? WIDE_LEVELS - 1 : 255;
+        for (int x = 0; x < job->out->width; x++) {
+            const float* wx = job->x_taps.weights + x*job->x_taps.max_taps;
+            const float* src = column_sums + job->x_taps.start[x];
+            float v = 0;
+            for (int k = 0; k < job->x_taps.count[x]; k++) {
+                v += wx[k]*src[k];
+            }
+            v = v <= 0 ? 0 : v >= max_level ? max_level : v + 0.5f;
+            if (wide) {
+                ((uint16_t*)dst)[x] = (uint16_t)v;
+            } else {
+                dst[x] = (unsigned char)v;
+            }
         }
     }
-    return (MinMax){.min = min, .max = max};
+    free(column_sums);
+    free(rows);
+}
+
+static Image sampleBrightness(const Image img, int step, LithoFilter filter, int n_threads, Histogram* hist) {
+    const int wide = img.type != LITHO_PIXELS_U8;
+    Image out = {.width = img.width/step, .height = img.height/step, .channels = 1, .img = NULL, .type = wide ? LITHO_PIXELS_U16 : LITHO_PIXELS_U8};
+    out.img = (unsigned char*)malloc((size_t)out.width*out.height*pixelTypeSize(out.type));
+    int n_tasks = (out.height + SAMPLE_ROWS_PER_TASK - 1)/SAMPLE_ROWS_PER_TASK;
+    n_tasks = n_tasks > 0 ? n_tasks : 1;
+    *hist = (Histogram){0};
+    if (wide) {
+        hist->wide_counts = (uint64_t*)calloc(WIDE_LEVELS, sizeof(uint64_t));
+    }
+    SampleJob job = {.img = &img, .step = step, .filter = filter, .out = &out, .hist = hist};
+    job.partial = wide ? NULL : (Histogram*)calloc(n_tasks, sizeof(Histogram));
+    if (filter != LITHO_FILTER_POINT) {
+        job.x_taps = makeFilterTaps(filter, step, out.width, img.width);
+        job.y_taps = makeFilterTaps(filter, step, out.height, img.height);
+    }
+    parallelFor(n_tasks, n_threads, sampleBrightnessTask, &job);
+    if (filter != LITHO_FILTER_POINT) {
+        freeFilterTaps(&job.x_taps);
+        freeFilterTaps(&job.y_taps);
+    }
+    if (!wide) {
+        *hist = mergeHistograms(job.partial, n_tasks);
+        free(job.partial);
+    }
+    return out;
 }
@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include "../include/litho.h"
+// the library is built from the same sources as the cli, whose --serve and --sweep parts it leaves unused
+#ifdef __GNUC__
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+#include "export.c"
+#ifdef __GNUC__
+#pragma GCC diagnostic pop
+#endif
+
+// liblitho, the functions in include/litho.h. They're thin wrappers over the same code main.c uses,
+// which keeps all of its state in the images, meshes and buffers it's passed.
+
+struct LithoImage {
+    Image img;
+};
+
+struct LithoModel {
+    Lithophane litho;
+    float* verts; // made by lithoVertices and lithoFaces
+    int* faces;
+};
+
+static LithoImage* wrapImage(Image img) {
+    if (!img.img) {
+        return NULL;
+    }
+    LithoImage* out = (LithoImage*)malloc(sizeof(LithoImage));
+    out->img = img;
+    return out;
+}
+
+LithoImage* lithoLoadImage(const char* filename, LithoLoadOptions load) {
+    return wrapImage(loadInputImage(filename, load, NULL));
+}
+LithoImage* lithoDecodeImage(const void* data, size_t size, LithoLoadOptions load) {
+    if (!data || size == 0) {
+        return NULL;
+    }
+    unsigned char* copy = (unsigned char*)malloc(size);
+    memcpy(copy, data, size);
+    return wrapImage(loadImageFromMemory(copy, size, load));
+}
+LithoImage* lithoImageFromPixels(const void* pixels, int width, int height, int channels, LithoPixelType type) {
+    if (!pixels || width <= 0 || height <= 0 || channels < 1 || channels > 4) {
+        return NULL;
+    }
+    size_t size = (size_t)width*height*channels*pixelTypeSize(type);
+    Image img = {.width = width, .height = height, .channels = channels, .type = type};
+    img.img = (unsigned char*)malloc(size);
+    memcpy(img.img, pixels, size);
+    return wrapImage(img);
+}
+void lithoImageSize(const LithoImage* img, int* width, int* height, int* channels) {
+    if (width) {
+        *width = img->img.width;
+    }
+    if (height) {
+        *height = img->img.height;
+    }
+    if (channels) {
+        *channels = img->img.channels;
+    }
+}
+void lithoFreeImage(LithoImage* img) {
+    if (img) {
+        freeImage(&img->img);
+        free(img);
+    }
+}
+
+LithoModel* lithoMakeModel(LithoImage* img, const LithoOptions* opts, int stream) {
+    if (!img) {
+        return NULL;
+    }
+    if (!opts || lithoOptionsError(opts) || !imageFitsGrid(img->img, opts->pixels_per_vertex)) {
+        lithoFreeImage(img);
+        return NULL;
+    }
+    LithoModel* model = (LithoModel*)calloc(1, sizeof(LithoModel));
+    model->litho = makeLithophane(img->img, *opts, stream, NULL);
+    free(img);
+    return model;
+}
+static MeshSource modelSource(const LithoModel* model) {
+    return lithophaneSource((Lithophane*)&model->litho); // reading a mesh doesn't change it
+}
+int lithoVertexCount(const LithoModel* model) {
+    return modelSource(model).n_verts;
+}
+int lithoFaceCount(const LithoModel* model) {
+    return modelSource(model).n_faces;
+}
+
+void lithoGetVertices(const LithoModel* model, int start, int count, float* xyz) {
+    MeshSource mesh = modelSource(model);
+    mesh.getVerts(mesh.ctx, start, count, (Pos*)xyz); // Pos is three packed floats
+}
+void lithoGetFaces(const LithoModel* model, int start, int count, int* indices) {
+    MeshSource mesh = modelSource(model);
+    mesh.getFaces(mesh.ctx, start, count, (Face*)indices);
+    for (int i = 0; i < count*3; i++) {
+        indices[i] -= 1; // faces are 1-based inside litho
+    }
+}
+const float* lithoVertices(LithoModel* model) {
+    if (!model->verts) {
+        int n = lithoVertexCount(model);
+        model->verts = (float*)malloc(sizeof(float)*3*(n > 0 ? n : 1));
+        lithoGetVertices(model, 0, n, model->verts);
+    }
+    return model->verts;
+}
+const int* lithoFaces(LithoModel* model) {
+    if (!model->faces) {
+        int n = lithoFaceCount(model);
+        model->faces = (int*)malloc(sizeof(int)*3*(n > 0 ? n : 1));
+        lithoGetFaces(model, 0, n, model->faces);
+    }
+    return model->faces;
+}
+void lithoFreeModel(LithoModel* model) {
+    if (model) {
+        freeLithophane(&model->litho);
+        free(model->verts);
+        free(model->faces);
+        free(model);
+    }
+}
+
+void lithoWriteModel(const LithoModel* model, LithoFormat format, LithoWriteFn write, void* user, int n_threads) {
+    OutBuf out = outBufInit(write, user);
+    writeMesh(modelSource(model), format, &out, 0, NULL, resolveThreads(n_threads));
+    outBufFree(&out);
+}
+int lithoSaveModel(const LithoModel* model, LithoFormat format, const char* filename, int n_threads) {
+    return saveMesh(modelSource(model), format, filename, 0, NULL, resolveThreads(n_threads), NULL);
+}
@@ -8,7 +8,12 @@
 #else
 #include <unistd.h>
 #endif
-#include "geometry.c"
+#include "export.c"
+#include "cache.c"
+#include "cli.c"
+#include "sweep.c"
+#include "batch.c"
+#include "serve.c"
 
 
 // ANSI color codes
@@ -22,7 +27,7 @@
 #define COLOR_CYAN    "\x1b[36m"
 
 // Get absolute path, with cross-platform support
-char* get_absolute_path(const char* path) {
+static char* get_absolute_path(const char* path) {
     char* abs_path = (char*)malloc(PATH_MAX);
     #ifdef _WIN32
         // Windows version
@@ -40,14 +45,31 @@ char* get_absolute_path(const char* path) {
     return abs_path;
 }
 
-void print_usage() {
-    LithoOptions defaults = defaultLithoOptions();
+static void print_usage() {
+    LithoOptions defaults = lithoDefaultOptions();
+    LithoLoadOptions load_defaults = lithoDefaultLoadOptions();
     printf("%s%sUsage:%s litho <input_image> [options]\n", COLOR_BOLD, COLOR_CYAN, COLOR_RESET);
+    printf("       litho --batch <list.txt|directory> [options]\n");
+    printf("       litho --serve <socket> [options]\n");
     printf("\n%sOptions:%s\n", COLOR_BOLD, COLOR_RESET);
     printf("  %s-o, --output%s <file>         Output file name (default: %slitho.obj%s)\n", COLOR_GREEN, COLOR_RESET, COLOR_YELLOW, COLOR_RESET);
+    printf("  %s--batch%s <list.txt|directory>  Convert every image in a directory, or listed in a file (one path per line).\n", COLOR_GREEN, COLOR_RESET);
+    printf("                               -o is then the output directory (default: %snext to each image%s)\n", COLOR_YELLOW, COLOR_RESET);
+    printf("  %s--serve%s <socket>            Keep running and take requests on a unix socket, with these options as defaults\n", COLOR_GREEN, COLOR_RESET);
+    printf("  %s--queue%s <n>                 With --serve, how many requests can wait for a worker (default: %s%d%s)\n", COLOR_GREEN, COLOR_RESET, COLOR_YELLOW, defaultSettings().queue, COLOR_RESET);
+    printf("  %s--cache%s <dir>               Keep finished meshes in dir, and reuse them for the same image and options\n", COLOR_GREEN, COLOR_RESET);
+    printf("  %s--cache_size%s <MB>           Most the cache can hold before the least recently used meshes go (default: %s%d%s)\n", COLOR_GREEN, COLOR_RESET, COLOR_YELLOW, (int)(defaultSettings().cache.max_bytes >> 20), COLOR_RESET);
+    printf("  %s--sweep%s <key=v1,v2,...>     Make the image with each of these values of an option, can be given for several options\n", COLOR_GREEN, COLOR_RESET);
+    printf("  %s--timings%s <table|json>      Report how long each phase took, as a table or as json on stderr\n", COLOR_GREEN, COLOR_RESET);
+    printf("  %s--format%s <obj|stl|3mf>      Output file format (default: %sobj%s)\n", COLOR_GREEN, COLOR_RESET, COLOR_YELLOW, COLOR_RESET);
+    printf("  %s--curve%s <linear|gamma|log|file.csv>  Tone curve for brightness (default: %slinear%s)\n", COLOR_GREEN, COLOR_RESET, COLOR_YELLOW, COLOR_RESET);
+    printf("  %s--curve_param%s <n>           Gamma exponent or log strength (default: %s2.2%s / %s10%s)\n", COLOR_GREEN, COLOR_RESET, COLOR_YELLOW, COLOR_RESET, COLOR_YELLOW, COLOR_RESET);
+    printf("  %s--stream%s                    Read grid heights off the image while writing instead of storing them\n", COLOR_GREEN, COLOR_RESET);
     printf("  %s--has_frame%s                 Add a frame (default: %s%d%s)\n", COLOR_GREEN, COLOR_RESET, COLOR_YELLOW, defaults.has_frame, COLOR_RESET);
+    printf("  %s--no_frame%s                  Leave the frame out, just the image and its backside\n", COLOR_GREEN, COLOR_RESET);
     printf("  %s--bevel_corners%s             Bevel the frame corners (default: %s%d%s)\n", COLOR_GREEN, COLOR_RESET, COLOR_YELLOW, defaults.bevel_corners, COLOR_RESET);
     printf("  %s--pixels_per_vertex%s <n>     Number of pixels per vertex (default: %s%d%s)\n", COLOR_GREEN, COLOR_RESET, COLOR_YELLOW, defaults.pixels_per_vertex, COLOR_RESET);
+    printf("  %s--filter%s <point|box|triangle|lanczos>  How pixels are combined into each vertex (default: %spoint%s)\n", COLOR_GREEN, COLOR_RESET, COLOR_YELLOW, COLOR_RESET);
     printf("  %s--min_thickness%s <mm>        Minimum thickness in mm (default: %s%.1f%s)\n", COLOR_GREEN, COLOR_RESET, COLOR_YELLOW, defaults.min_thickness, COLOR_RESET);
     printf("  %s--max_thickness%s <mm>        Maximum thickness in mm (default: %s%.1f%s)\n", COLOR_GREEN, COLOR_RESET, COLOR_YELLOW, defaults.max_thickness, COLOR_RESET);
     printf("  %s--bright_scale%s <n>          Brightness scaling factor (default: %s%.3f%s)\n", COLOR_GREEN, COLOR_RESET, COLOR_YELLOW, defaults.bright_scale, COLOR_RESET);
@@ -58,22 +80,17 @@ void print_usage() {
     printf("  %s--flip_x%s                    Flip along X axis (default: %s%d%s)\n", COLOR_GREEN, COLOR_RESET, COLOR_YELLOW, defaults.flip_x, COLOR_RESET);
     printf("  %s--flip_y%s                    Flip along Y axis (default: %s%d%s)\n", COLOR_GREEN, COLOR_RESET, COLOR_YELLOW, defaults.flip_y, COLOR_RESET);
     printf("  %s--flip_z%s                    Flip along Z axis (default: %s%d%s)\n", COLOR_GREEN, COLOR_RESET, COLOR_YELLOW, defaults.flip_z, COLOR_RESET);
+    printf("  %s--max_error%s <mm>            Simplify flat areas of the image, keeping heights within this error (default: %s%.2f%s, off)\n", COLOR_GREEN, COLOR_RESET, COLOR_YELLOW, defaults.max_error, COLOR_RESET);
+    printf("  %s--max_faces%s <n>             Simplify the mesh down to this many faces (default: %s%d%s, off)\n", COLOR_GREEN, COLOR_RESET, COLOR_YELLOW, defaults.max_faces, COLOR_RESET);
+    printf("  %s--simplify_error%s <mm>       Simplify the mesh as far as this error allows (default: %s%.2f%s, off)\n", COLOR_GREEN, COLOR_RESET, COLOR_YELLOW, defaults.simplify_error, COLOR_RESET);
+    printf("  %s--crop%s <x,y,w,h>            Only use this part of the image, in pixels (default: %swhole image%s)\n", COLOR_GREEN, COLOR_RESET, COLOR_YELLOW, COLOR_RESET);
+    printf("  %s--decode_scale%s <n>          Shrink the image by this factor as soon as it's loaded (default: %s%d%s)\n", COLOR_GREEN, COLOR_RESET, COLOR_YELLOW, load_defaults.scale, COLOR_RESET);
+    printf("  %s--threads%s <n>               Number of threads to use, 0 for one per core (default: %s%d%s)\n", COLOR_GREEN, COLOR_RESET, COLOR_YELLOW, defaults.threads, COLOR_RESET);
     printf("\n%sExample:%s\n", COLOR_BOLD, COLOR_RESET);
     printf("  litho %simage.png%s %s--bevel_corners --frame_width=25%s -o %soutput.obj%s\n", 
            COLOR_MAGENTA, COLOR_RESET, COLOR_GREEN, COLOR_RESET, COLOR_MAGENTA, COLOR_RESET);
 }
 
-// Helper function to get option value, either from next argument or after '='
-const char* get_option_value(const char* arg, int* should_increment_i) {
-    char* equals_pos = strchr(arg, '=');
-    if (equals_pos) {
-        *should_increment_i = 0;
-        return equals_pos + 1;
-    }
-    *should_increment_i = 1;
-    return NULL;
-}
-
 int main(int argc, char *argv[]) {
     if (argc < 2) {
         print_usage();
@@ -81,77 +98,118 @@ int main(int argc, char *argv[]) {
     }
 
     const char* input_file = argv[1];
-    const char* output_file = "litho.obj";
-    LithoOptions opts = defaultLithoOptions();
-
-    // Parse command line arguments
-    for (int i = 2; i < argc; i++) {
+    const char* batch_source = NULL;
+    const char* socket_path = NULL;
+    int first_option = 2;
+    if (strncmp(argv[1], "--batch", 7) == 0 || strncmp(argv[1], "--serve", 7) == 0) { // these take the place of the input image
         int should_increment_i = 0;
-        const char* value = get_option_value(argv[i], &should_increment_i);
-        
-        if (strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--output") == 0) {
-            if (i + 1 < argc) {
-                output_file = argv[++i];
-            }
-        } else if (strcmp(argv[i], "--has_frame") == 0) {
-            opts.has_frame = 1;
-        } else if (strcmp(argv[i], "--bevel_corners") == 0) {
-            opts.bevel_corners = 1;
-        } else if (strncmp(argv[i], "--pixels_per_vertex", 18) == 0) {
-            if (value || (i + 1 < argc)) {
-                opts.pixels_per_vertex = atoi(value ? value : argv[++i]);
-            }
-        } else if (strncmp(argv[i], "--min_thickness", 14) == 0) {
-            if (value || (i + 1 < argc)) {
-                opts.min_thickness = atof(value ? value : argv[++i]);
-            }
-        } else if (strncmp(argv[i], "--max_thickness", 14) == 0) {
-            if (value || (i + 1 < argc)) {
-                opts.max_thickness = atof(value ? value : argv[++i]);
-            }
-        } else if (strncmp(argv[i], "--bright_scale", 13) == 0) {
-            if (value || (i + 1 < argc)) {
-                opts.bright_scale = atof(value ? value : argv[++i]);
-            }
-        } else if (strncmp(argv[i], "--frame_thickness", 16) == 0) {
-            if (value || (i + 1 < argc)) {
-                opts.frame_thickness = atof(value ? value : argv[++i]);
-            }
-        } else if (strncmp(argv[i], "--frame_angle", 12) == 0) {
-            if (value || (i + 1 < argc)) {
-                opts.frame_angle = atof(value ? value : argv[++i]);
-            }
-        } else if (strncmp(argv[i], "--frame_width", 12) == 0) {
-            if (value || (i + 1 < argc)) {
-                opts.frame_width = atof(value ? value : argv[++i]);
-            }
-        } else if (strncmp(argv[i], "--scale", 7) == 0) {
-            if (value || (i + 1 < argc)) {
-                opts.scale = atof(value ? value : argv[++i]);
-            }
-        } else if (strcmp(argv[i], "--flip_x") == 0) {
-            opts.flip_x = 1;
-        } else if (strcmp(argv[i], "--flip_y") == 0) {
-            opts.flip_y = 1;
-        } else if (strcmp(argv[i], "--flip_z") == 0) {
-            opts.flip_z = 1;
-        } else {
-            printf("%sUnknown option:%s %s\n", COLOR_RED, COLOR_RESET, argv[i]);
+        const char* value = get_option_value(argv[1], &should_increment_i);
+        if (!value && argc < 3) {
             print_usage();
             return 1;
         }
+        if (argv[1][2] == 'b') {
+            batch_source = value ? value : argv[2];
+        } else {
+            socket_path = value ? value : argv[2];
+        }
+        first_option = value ? 2 : 3;
+    }
+    Settings settings = defaultSettings();
+
+    char error[512];
+    if (!parseOptions(argc, argv, first_option, &settings, error, sizeof(error)) || !checkSettings(&settings, error, sizeof(error))) {
+        printf("%sError:%s %s\n", COLOR_RED, COLOR_RESET, error);
+        print_usage();
+        free(settings.opts.curve_points);
+        return 1;
+    }
+    const char* output_file = settings.output_file;
+    LithoFormat format = settings.format;
+    int use_stream = settings.use_stream;
+    LithoOptions opts = settings.opts;
+    LithoLoadOptions load = settings.load;
+
+    if (settings.n_sweeps > 0 && (socket_path || batch_source)) {
+        printf("%sError:%s --sweep only works on a single image\n", COLOR_RED, COLOR_RESET);
+        free(opts.curve_points);
+        return 1;
+    }
+    if (settings.timings && (socket_path || batch_source || settings.n_sweeps > 0)) {
+        printf("%sError:%s --timings only works on a single image, without --sweep\n", COLOR_RED, COLOR_RESET);
+        free(opts.curve_points);
+        return 1;
+    }
+    if (socket_path) {
+        runServer(socket_path, settings); // only returns if it can't listen
+        printf("%sError:%s Could not listen on '%s%s%s': %s\n", COLOR_RED, COLOR_RESET, COLOR_YELLOW, socket_path, COLOR_RESET, strerror(errno));
+        free(opts.curve_points);
+        return 1;
+    }
+    if (batch_source) {
+        PathList inputs = {0};
+        if (!readBatchList(batch_source, &inputs) || inputs.n == 0) {
+            printf("%sError:%s No images to convert in '%s%s%s'\n", COLOR_RED, COLOR_RESET, COLOR_YELLOW, batch_source, COLOR_RESET);
+            freePathList(&inputs);
+            free(opts.curve_points);
+            return 1;
+        }
+        int failed = runBatch(&inputs, output_file, format, opts, load, use_stream, settings.cache, argc, argv);
+        printf("%sConverted%s %s%d%s of %s%d%s images\n", COLOR_GREEN, COLOR_RESET, COLOR_CYAN, inputs.n - failed, COLOR_RESET, COLOR_CYAN, inputs.n, COLOR_RESET);
+        freePathList(&inputs);
+        free(opts.curve_points);
+        return failed ? 1 : 0;
+    }
+
+    SweepPlan plan = {0};
+    if (settings.n_sweeps > 0 && !planSweep(&settings, &plan, error, sizeof(error))) {
+        printf("%sError:%s %s\n", COLOR_RED, COLOR_RESET, error);
+        free(opts.curve_points);
+        return 1;
+    }
+
+    if (output_file == NULL) {
+        output_file = format == LITHO_FORMAT_STL ? "litho.stl" : format == LITHO_FORMAT_3MF ? "litho.3mf" : "litho.obj";
     }
 
     // Get absolute paths
     char* abs_input_path = get_absolute_path(input_file);
     char* abs_output_path = get_absolute_path(output_file);
 
+    char cache_key[65];
+    int cached = settings.cache.dir && plan.n == 0 && !settings.timings && cacheKey(abs_input_path, format, &opts, &load, cache_key);
+    if (cached && cacheFetch(&settings.cache, cache_key, format, abs_output_path)) {
+        printf("%sSaved lithophane%s from the cache to: '%s%s%s'\n", COLOR_GREEN, COLOR_RESET, COLOR_YELLOW, abs_output_path, COLOR_RESET);
+        free(abs_input_path);
+        free(abs_output_path);
+        free(opts.curve_points);
+        return 0;
+    }
+
+    Timings run_timings = {.start = monotonicSeconds()};
+    Timings* timings = settings.timings ? &run_timings : NULL;
+
     // Load and process image
-    Image img = loadInputImage(abs_input_path);
+    Image img = loadInputImage(abs_input_path, load, timings);
     if(img.img == NULL) {
         printf("%sError:%s Failed to load image: '%s%s%s'\n", COLOR_RED, COLOR_RESET, COLOR_YELLOW, abs_input_path, COLOR_RESET);
         free(abs_input_path);
         free(abs_output_path);
+        freeSweepPlan(&plan);
+        free(opts.curve_points);
+        return 1;
+    }
+    int fits = plan.n > 0 || imageFitsGrid(img, opts.pixels_per_vertex);
+    for (int i = 0; i < plan.n; i++) {
+        fits = fits && imageFitsGrid(img, plan.variants[i].settings.opts.pixels_per_vertex);
+    }
+    if (!fits) {
+        printf("%sError:%s Image too small for --pixels_per_vertex: '%s%s%s' (%dx%d)\n", COLOR_RED, COLOR_RESET, COLOR_YELLOW, abs_input_path, COLOR_RESET, img.width, img.height);
+        freeImage(&img);
+        free(abs_input_path);
+        free(abs_output_path);
+        freeSweepPlan(&plan);
+        free(opts.curve_points);
         return 1;
     }
     printf("%sLoaded image%s '%s%s%s' of shape (%s%d%s, %s%d%s, %s%d%s)\n", 
@@ -160,22 +218,46 @@ int main(int argc, char *argv[]) {
            COLOR_CYAN, img.height, COLOR_RESET,
            COLOR_CYAN, img.width, COLOR_RESET,
            COLOR_CYAN, img.channels, COLOR_RESET);
-    
-    Obj litho = makeLithoObj(img, opts);
+
+    if (plan.n > 0) {
+        int failed = runSweep(img, &plan, abs_output_path, argc, argv);
+        printf("%sSaved%s %s%d%s of %s%d%s variants\n", COLOR_GREEN, COLOR_RESET, COLOR_CYAN, plan.n - failed, COLOR_RESET, COLOR_CYAN, plan.n, COLOR_RESET);
+        freeSweepPlan(&plan);
+        free(abs_input_path);
+        free(abs_output_path);
+        free(opts.curve_points);
+        return failed ? 1 : 0;
+    }
+
+    Lithophane litho = makeLithophane(img, opts, use_stream, timings);
+    MeshSource mesh = lithophaneSource(&litho);
     printf("%sCreated lithophane%s with %s%d%s vertices and %s%d%s faces\n", 
            COLOR_GREEN, COLOR_RESET,
-           COLOR_CYAN, litho.n_verts, COLOR_RESET,
-           COLOR_CYAN, litho.n_faces, COLOR_RESET);
+           COLOR_CYAN, mesh.n_verts, COLOR_RESET,
+           COLOR_CYAN, mesh.n_faces, COLOR_RESET);
 
-    saveObj(litho, abs_output_path, argc, argv);
-    printf("%sSaved lithophane%s to: '%s%s%s'\n", 
-           COLOR_GREEN, COLOR_RESET,
-           COLOR_YELLOW, abs_output_path, COLOR_RESET);
+    if (settings.cache.dir) {
+        unlinkIfShared(abs_output_path);
+    }
+    int saved = saveMesh(mesh, format, abs_output_path, argc, argv, resolveThreads(opts.threads), timings);
+    if (saved && cached) {
+        cacheStore(&settings.cache, cache_key, format, abs_output_path);
+    }
+    if (saved) {
+        printf("%sSaved lithophane%s to: '%s%s%s'\n", 
+               COLOR_GREEN, COLOR_RESET,
+               COLOR_YELLOW, abs_output_path, COLOR_RESET);
+    } else {
+        printf("%sError:%s Failed to write: '%s%s%s'\n", COLOR_RED, COLOR_RESET, COLOR_YELLOW, abs_output_path, COLOR_RESET);
+    }
+    if (settings.timings) {
+        printTimings(&run_timings, settings.timings, settings.timings == TIMINGS_JSON ? stderr : stdout);
+    }
 
     // Clean up
     free(abs_input_path);
     free(abs_output_path);
-    free(litho.verts);
-    free(litho.faces);
-    return 0;
+    freeLithophane(&litho);
+    free(opts.curve_points);
+    return saved ? 0 : 1;
 }
@@ -0,0 +1,383 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#ifndef _WIN32
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#endif
+
+// --serve: a long running process taking requests on a unix socket, so a front end doesn't pay for
+// starting litho for every mesh. One request per connection:
+//   the client sends a line with an image path and options, just like a command line without the litho:
+//       photo.jpg --format stl --pixels_per_vertex 3
+//   or - in place of the path, with the image file's bytes following the line until the client shuts down its side.
+//   the answer is "ok <vertices> <faces>\n" followed by the mesh file, or "error <message>\n".
+// Options given after --serve are the defaults for every request. A pool of --threads workers takes
+// the requests, each building one mesh at a time on its own thread. Up to --queue accepted requests
+// wait for a worker, past that new ones are answered "error busy" right away. Workers keep their
+// buffers from one request to the next.
+// The last few images are kept as LithoStages (see geometry.c), so a client trying option after
+// option on one image only pays for the stages those options change. An image is known by its
+// path, size and modification time, or by the uploaded bytes, along with the crop and decode scale.
+// expects cli.c to be included first
+
+#ifndef _WIN32
+
+#define SERVE_MAX_LINE 65536
+#define SERVE_MAX_ARGS 256
+#define SERVE_MAX_UPLOAD ((size_t)1 << 30) // bytes. larger uploads are turned away
+#define SERVE_TIMEOUT 30 // seconds a client can go without sending or taking data
+
+typedef struct {
+    char key[65]; // which image, see stagesKey
+    LithoStages stages;
+    uint64_t used; // for dropping the least recently used
+} StagedImage;
+
+typedef struct {
+    int listen_fd;
+    Settings defaults;
+    int* queue; // connections waiting for a worker, a ring of queue_size
+    int queue_size;
+    int queue_start;
+    int queue_len;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    StagedImage* staged; // images not being worked on right now, up to one per worker
+    int n_staged;
+    int max_staged;
+    uint64_t n_used;
+    pthread_mutex_t staged_lock;
+} Server;
+
+// the image a request is for: the upload's bytes, or the file's path, size and modification time
+static int stagesKey(const char* path, const unsigned char* data, size_t size, LithoLoadOptions load, char key[65]) {
+    Sha256 h = sha256Init();
+    if (data) {
+        sha256Update(&h, data, size);
+    } else {
+        struct stat st;
+        if (stat(path, &st) != 0) {
+            return 0;
+        }
+        int64_t stamp[3] = {st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+        sha256Update(&h, path, strlen(path) + 1);
+        sha256Update(&h, stamp, sizeof(stamp));
+    }
+    HASH_FIELD(&h, load); // all ints, no padding
+    sha256Hex(&h, key);
+    return 1;
+}
+// takes the kept stages for key out for this worker. 0 if there are none
+static int takeStages(Server* server, const char* key, StagedImage* out) {
+    int found = 0;
+    pthread_mutex_lock(&server->staged_lock);
+    for (int i = 0; i < server->n_staged && !found; i++) {
+        if (strcmp(server->staged[i].key, key) == 0) {
+            *out = server->staged[i];
+            server->staged[i] = server->staged[--server->n_staged];
+            found = 1;
+        }
+    }
+    pthread_mutex_unlock(&server->staged_lock);
+    return found;
+}
+static void keepStages(Server* server, StagedImage* staged) { // hands the stages back, dropping the least recently used if there's no room
+    StagedImage dropped = {0};
+    pthread_mutex_lock(&server->staged_lock);
+    staged->used = ++server->n_used;
+    if (server->n_staged == server->max_staged) {
+        int oldest = 0;
+        for (int i = 1; i < server->n_staged; i++) {
+            if (server->staged[i].used < server->staged[oldest].used) {
+                oldest = i;
+            }
+        }
+        dropped = server->staged[oldest];
+        server->staged[oldest] = server->staged[--server->n_staged];
+    }
+    server->staged[server->n_staged++] = *staged;
+    pthread_mutex_unlock(&server->staged_lock);
+    freeLithoStages(&dropped.stages);
+}
+
+static int sendAll(int fd, const void* data, size_t len) {
+    const char* p = (const char*)data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+static void sendError(int fd, const char* message) {
+    char line[600];
+    int len = snprintf(line, sizeof(line), "error %s\n", message);
+    sendAll(fd, line, len < (int)sizeof(line) ? len : (int)sizeof(line) - 1);
+}
+
+typedef struct {
+    int fd;
+    int ok; // cleared when the client goes away, the rest of the mesh is then dropped
+} SocketOut;
+
+static void flushToSocket(void* ctx, const char* data, size_t len) {
+    SocketOut* out = (SocketOut*)ctx;
+    if (out->ok) {
+        out->ok = sendAll(out->fd, data, len);
+    }
+}
+
+// reads and drops the rest of an upload that won't be used. closing the socket with it unread
+// would reset the connection, and the client could lose the error sent before it
+static void discardUpload(int fd) {
+    char buf[1 << 16];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) != 0) {
+        if (n < 0 && errno != EINTR) {
+            return;
+        }
+    }
+}
+
+// reads the rest of an uploaded image, after the start bytes that came in with the request line.
+// NULL if the connection fails, or with errno EFBIG if it's over SERVE_MAX_UPLOAD
+static unsigned char* readUpload(int fd, const char* start, size_t start_len, size_t* size) {
+    size_t cap = start_len > (1 << 20) ? start_len*2 : (1 << 20);
+    unsigned char* data = (unsigned char*)malloc(cap);
+    memcpy(data, start, start_len);
+    *size = start_len;
+    while (1) {
+        if (*size > SERVE_MAX_UPLOAD) {
+            free(data);
+            discardUpload(fd);
+            errno = EFBIG;
+            return NULL;
+        }
+        if (*size == cap) {
+            cap *= 2;
+            data = (unsigned char*)realloc(data, cap);
+        }
+        ssize_t n = read(fd, data + *size, cap - *size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            free(data);
+            return NULL;
+        }
+        if (n == 0) {
+            return data;
+        }
+        *size += n;
+    }
+}
+
+static void handleRequest(Server* server, int fd, char* line, OutBuf* out) {
+    size_t len = 0;
+    char* newline = NULL;
+    while (!newline && len < SERVE_MAX_LINE - 1) {
+        ssize_t n = read(fd, line + len, SERVE_MAX_LINE - 1 - len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        newline = (char*)memchr(line + len, '\n', n);
+        len += n;
+    }
+    if (!newline) {
+        sendError(fd, "expected a request line");
+        return;
+    }
+    *newline = '\0';
+    char* args[SERVE_MAX_ARGS];
+    int n_args = 0;
+    args[n_args++] = (char*)"litho"; // so the options start at 2, like on the command line
+    char* save = NULL;
+    for (char* tok = strtok_r(line, " \t\r", &save); tok && n_args < SERVE_MAX_ARGS; tok = strtok_r(NULL, " \t\r", &save)) {
+        args[n_args++] = tok;
+    }
+    if (n_args < 2) {
+        sendError(fd, "expected an image path or -");
+        return;
+    }
+    Settings s = server->defaults;
+    char error[512] = "";
+    int parsed = parseOptions(n_args, args, 2, &s, error, sizeof(error));
+    if (parsed && s.n_sweeps > 0) {
+        snprintf(error, sizeof(error), "--sweep only works from the command line");
+        parsed = 0;
+    }
+    parsed = parsed && checkSettings(&s, error, sizeof(error));
+    if (parsed) {
+        StagedImage staged = {0};
+        int have_key;
+        if (strcmp(args[1], "-") == 0) {
+            size_t size = 0;
+            errno = 0;
+            unsigned char* data = readUpload(fd, newline + 1, len - (newline + 1 - line), &size);
+            have_key = data && stagesKey(NULL, data, size, s.load, staged.key);
+            if (!data && errno == EFBIG) {
+                snprintf(error, sizeof(error), "upload over %d MB", (int)(SERVE_MAX_UPLOAD >> 20));
+            } else if (have_key && takeStages(server, staged.key, &staged)) {
+                free(data);
+            } else {
+                staged.stages = initLithoStages(loadImageFromMemory(data, size, s.load));
+            }
+        } else {
+            have_key = stagesKey(args[1], NULL, 0, s.load, staged.key);
+            if (!have_key || !takeStages(server, staged.key, &staged)) {
+                staged.stages = initLithoStages(loadInputImage(args[1], s.load, NULL));
+            }
+        }
+        if (staged.stages.image.img && !imageFitsGrid(staged.stages.image, s.opts.pixels_per_vertex)) {
+            sendError(fd, "image too small for --pixels_per_vertex");
+            if (have_key) {
+                keepStages(server, &staged); // still good for requests with other options
+            } else {
+                freeLithoStages(&staged.stages);
+            }
+        } else if (staged.stages.image.img) {
+            s.opts.threads = 1;
+            Lithophane litho = stagedLithophane(&staged.stages, s.opts);
+            MeshSource mesh = lithophaneSource(&litho);
+            SocketOut sock = {.fd = fd, .ok = 1};
+            out->flush = flushToSocket;
+            out->ctx = &sock;
+            char status[64];
+            snprintf(status, sizeof(status), "ok %d %d\n", mesh.n_verts, mesh.n_faces);
+            putStr(out, status);
+            writeMesh(mesh, s.format, out, n_args, args, 1);
+            outBufFlush(out);
+            out->ctx = NULL;
+            freeLithophane(&litho);
+            if (have_key) {
+                keepStages(server, &staged);
+            } else {
+                freeLithoStages(&staged.stages);
+            }
+        } else {
+            sendError(fd, error[0] ? error : "failed to load image");
+        }
+    } else {
+        if (strcmp(args[1], "-") == 0) {
+            discardUpload(fd);
+        }
+        sendError(fd, error);
+    }
+    if (s.opts.curve_points != server->defaults.opts.curve_points) { // the request read its own curve file
+        free(s.opts.curve_points);
+    }
+}
+
+static void* serveWorker(void* arg) {
+    Server* server = (Server*)arg;
+    OutBuf out = outBufInit(NULL, NULL);
+    char* line = (char*)malloc(SERVE_MAX_LINE);
+    while (1) {
+        pthread_mutex_lock(&server->lock);
+        while (server->queue_len == 0) {
+            pthread_cond_wait(&server->ready, &server->lock);
+        }
+        int fd = server->queue[server->queue_start];
+        server->queue_start = (server->queue_start + 1) % server->queue_size;
+        server->queue_len--;
+        pthread_mutex_unlock(&server->lock);
+        handleRequest(server, fd, line, &out);
+        close(fd);
+    }
+    return NULL;
+}
+
+// listens on socket_path and handles requests until the process is killed. returns 0 if it can't listen
+static int runServer(const char* socket_path, Settings defaults) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+    strcpy(addr.sun_path, socket_path);
+    struct stat st;
+    if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) { // left over from an earlier run
+        unlink(socket_path);
+    }
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        return 0;
+    }
+    int queue_size = defaults.queue > 0 ? defaults.queue : 1;
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listen_fd, queue_size) != 0) {
+        close(listen_fd);
+        return 0;
+    }
+    signal(SIGPIPE, SIG_IGN); // clients that hang up early show up as failed writes instead
+
+    Server server = {.listen_fd = listen_fd, .defaults = defaults, .queue_size = queue_size};
+    server.queue = (int*)malloc(sizeof(int)*queue_size);
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.ready, NULL);
+    int n_workers = resolveThreads(defaults.opts.threads);
+    server.max_staged = n_workers;
+    server.staged = (StagedImage*)malloc(sizeof(StagedImage)*n_workers);
+    pthread_mutex_init(&server.staged_lock, NULL);
+    for (int i = 0; i < n_workers; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serveWorker, &server) == 0) {
+            pthread_detach(thread);
+        }
+    }
+    printf("Listening on '%s' with %d workers\n", socket_path, n_workers);
+    fflush(stdout);
+
+    struct timeval timeout = {.tv_sec = SERVE_TIMEOUT, .tv_usec = 0};
+    while (1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR) {
+                usleep(10000); // out of file descriptors or the like, give requests in progress a moment
+            }
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        pthread_mutex_lock(&server.lock);
+        if (server.queue_len == server.queue_size) {
+            pthread_mutex_unlock(&server.lock);
+            sendError(fd, "busy");
+            char drain[4096]; // closing with the request unread would reset the connection and lose the answer
+            while (recv(fd, drain, sizeof(drain), MSG_DONTWAIT) > 0) {
+            }
+            close(fd);
+            continue;
+        }
+        server.queue[(server.queue_start + server.queue_len) % server.queue_size] = fd;
+        server.queue_len++;
+        pthread_cond_signal(&server.ready);
+        pthread_mutex_unlock(&server.lock);
+    }
+    return 1;
+}
+
+#else
+
+static int runServer(const char* socket_path, Settings defaults) { // there are no unix sockets to serve on
+    errno = ENOSYS;
+    return 0;
+}
+
+#endif
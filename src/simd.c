@@ -0,0 +1,255 @@
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#if (defined(__x86_64__) || defined(__i386__) || defined(_M_X64)) && !defined(LITHO_NO_SIMD)
+#include <immintrin.h>
+#define LITHO_SSE2 1
+#if defined(__GNUC__)
+#define LITHO_AVX2 1 // built with a target attribute and picked at runtime, so no -mavx2 needed
+#endif
+#endif
+
+// Vector kernels for the per pixel steps: colour to brightness, resampling, and brightness to height,
+// the last two also for 16 bit brightness.
+// They give exactly the same results as the scalar code (the same double operations in the same
+// order, no fused multiply-adds, and heights are table lookups), so the output doesn't depend on which one runs.
+// SSE2 is used on any x86-64, AVX2 when the cpu has it. Build with -DLITHO_NO_SIMD for scalar only.
+
+static inline unsigned char lumaScalar(int r, int g, int b) { // floor(RGBbrightness(r, g, b))
+    return floor((float)(0.299*r + 0.587*g + 0.114*b));
+}
+
+#ifdef LITHO_AVX2
+__attribute__((target("avx2")))
+static int lumaAvx2(const unsigned char* px, int channels, int n, unsigned char* out) { // returns how many pixels it did
+    const __m256d wr = _mm256_set1_pd(0.299), wg = _mm256_set1_pd(0.587), wb = _mm256_set1_pd(0.114);
+    const __m128i pick_r = _mm_setr_epi8(0, -1, -1, -1, 3, -1, -1, -1, 6, -1, -1, -1, 9, -1, -1, -1);
+    const __m128i pick_g = _mm_setr_epi8(1, -1, -1, -1, 4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1);
+    const __m128i pick_b = _mm_setr_epi8(2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1);
+    const __m128i mask = _mm_set1_epi32(0xFF);
+    int i = 0;
+    // 4 pixels at a time. rgb loads 16 bytes for 12, so stop early enough not to read past the end
+    for (; (channels == 4 && i + 4 <= n) || (channels == 3 && i + 6 <= n); i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(px + i*channels));
+        __m128i r, g, b;
+        if (channels == 4) {
+            r = _mm_and_si128(v, mask);
+            g = _mm_and_si128(_mm_srli_epi32(v, 8), mask);
+            b = _mm_and_si128(_mm_srli_epi32(v, 16), mask);
+        } else {
+            r = _mm_shuffle_epi8(v, pick_r);
+            g = _mm_shuffle_epi8(v, pick_g);
+            b = _mm_shuffle_epi8(v, pick_b);
+        }
+        __m256d d = _mm256_add_pd(_mm256_mul_pd(wr, _mm256_cvtepi32_pd(r)), _mm256_mul_pd(wg, _mm256_cvtepi32_pd(g)));
+        d = _mm256_add_pd(d, _mm256_mul_pd(wb, _mm256_cvtepi32_pd(b)));
+        __m128i y = _mm_cvttps_epi32(_mm256_cvtpd_ps(d)); // never negative, so truncating is floor
+        y = _mm_packus_epi16(_mm_packs_epi32(y, y), y);
+        uint32_t packed = _mm_cvtsi128_si32(y);
+        memcpy(out + i, &packed, 4);
+    }
+    return i;
+}
+#endif
+
+#ifdef LITHO_SSE2
+static int lumaSse2(const unsigned char* px, int channels, int n, unsigned char* out) { // returns how many pixels it did
+    const __m128d wr = _mm_set1_pd(0.299), wg = _mm_set1_pd(0.587), wb = _mm_set1_pd(0.114);
+    const __m128i mask = _mm_set1_epi32(0xFF);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const unsigned char* p = px + i*channels;
+        __m128i r, g, b;
+        if (channels == 4) {
+            __m128i v = _mm_loadu_si128((const __m128i*)p);
+            r = _mm_and_si128(v, mask);
+            g = _mm_and_si128(_mm_srli_epi32(v, 8), mask);
+            b = _mm_and_si128(_mm_srli_epi32(v, 16), mask);
+        } else {
+            r = _mm_setr_epi32(p[0], p[3], p[6], p[9]);
+            g = _mm_setr_epi32(p[1], p[4], p[7], p[10]);
+            b = _mm_setr_epi32(p[2], p[5], p[8], p[11]);
+        }
+        __m128 f[2];
+        for (int half = 0; half < 2; half++) { // 2 doubles per register
+            __m128d d = _mm_add_pd(_mm_mul_pd(wr, _mm_cvtepi32_pd(r)), _mm_mul_pd(wg, _mm_cvtepi32_pd(g)));
+            d = _mm_add_pd(d, _mm_mul_pd(wb, _mm_cvtepi32_pd(b)));
+            f[half] = _mm_cvtpd_ps(d);
+            r = _mm_srli_si128(r, 8);
+            g = _mm_srli_si128(g, 8);
+            b = _mm_srli_si128(b, 8);
+        }
+        __m128i y = _mm_cvttps_epi32(_mm_movelh_ps(f[0], f[1]));
+        y = _mm_packus_epi16(_mm_packs_epi32(y, y), y);
+        uint32_t packed = _mm_cvtsi128_si32(y);
+        memcpy(out + i, &packed, 4);
+    }
+    return i;
+}
+#endif
+
+// brightness of n pixels with 3 (rgb) or 4 (rgba) channels
+static void lumaRow(const unsigned char* px, int channels, int n, unsigned char* out) {
+    int i = 0;
+#ifdef LITHO_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        i = lumaAvx2(px, channels, n, out);
+    } else
+#endif
+    {
+#ifdef LITHO_SSE2
+        i = lumaSse2(px, channels, n, out);
+#endif
+    }
+    for (; i < n; i++) {
+        const unsigned char* p = px + i*channels;
+        out[i] = lumaScalar(p[0], p[1], p[2]);
+    }
+}
+
+#ifdef LITHO_AVX2
+__attribute__((target("avx2")))
+static int heightAvx2(const unsigned char* src, int n, const float* lut, float* out) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i b = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src + i)));
+        _mm256_storeu_ps(out + i, _mm256_i32gather_ps(lut, b, 4));
+    }
+    return i;
+}
+#endif
+
+// heights of n grid vertices, looking up the n brightness values starting at src in a 256 entry table
+static void heightRow(const unsigned char* src, int n, const float* lut, float* out) {
+    int i = 0;
+#ifdef LITHO_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        i = heightAvx2(src, n, lut, out);
+    }
+#endif
+    for (; i < n; i++) {
+        out[i] = lut[src[i]];
+    }
+}
+
+#ifdef LITHO_AVX2
+__attribute__((target("avx2")))
+static int height16Avx2(const uint16_t* src, int n, const float* lut, float* out) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i b = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(src + i)));
+        _mm256_storeu_ps(out + i, _mm256_i32gather_ps(lut, b, 4));
+    }
+    return i;
+}
+#endif
+
+// heightRow for 16 bit brightness, in a 65536 entry table
+static void heightRow16(const uint16_t* src, int n, const float* lut, float* out) {
+    int i = 0;
+#ifdef LITHO_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        i = height16Avx2(src, n, lut, out);
+    }
+#endif
+    for (; i < n; i++) {
+        out[i] = lut[src[i]];
+    }
+}
+
+#ifdef LITHO_AVX2
+__attribute__((target("avx2")))
+static int addWeightedRowAvx2(float* acc, const unsigned char* row, float w, int n) {
+    const __m256 vw = _mm256_set1_ps(w);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(row + i))));
+        _mm256_storeu_ps(acc + i, _mm256_add_ps(_mm256_loadu_ps(acc + i), _mm256_mul_ps(v, vw)));
+    }
+    return i;
+}
+#endif
+
+#ifdef LITHO_SSE2
+static int addWeightedRowSse2(float* acc, const unsigned char* row, float w, int n) {
+    const __m128 vw = _mm_set1_ps(w);
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)(row + i));
+        __m128i lo = _mm_unpacklo_epi8(bytes, zero), hi = _mm_unpackhi_epi8(bytes, zero);
+        __m128i parts[4] = {_mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero), _mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero)};
+        for (int k = 0; k < 4; k++) {
+            __m128 v = _mm_cvtepi32_ps(parts[k]);
+            _mm_storeu_ps(acc + i + 4*k, _mm_add_ps(_mm_loadu_ps(acc + i + 4*k), _mm_mul_ps(v, vw)));
+        }
+    }
+    return i;
+}
+#endif
+
+// acc[i] += w*row[i] for n values, the vertical half of the resampling filters
+static void addWeightedRow(float* acc, const unsigned char* row, float w, int n) {
+    int i = 0;
+#ifdef LITHO_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        i = addWeightedRowAvx2(acc, row, w, n);
+    } else
+#endif
+    {
+#ifdef LITHO_SSE2
+        i = addWeightedRowSse2(acc, row, w, n);
+#endif
+    }
+    for (; i < n; i++) {
+        acc[i] += w*row[i];
+    }
+}
+
+#ifdef LITHO_AVX2
+__attribute__((target("avx2")))
+static int addWeightedRow16Avx2(float* acc, const uint16_t* row, float w, int n) {
+    const __m256 vw = _mm256_set1_ps(w);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(row + i))));
+        _mm256_storeu_ps(acc + i, _mm256_add_ps(_mm256_loadu_ps(acc + i), _mm256_mul_ps(v, vw)));
+    }
+    return i;
+}
+#endif
+
+#ifdef LITHO_SSE2
+static int addWeightedRow16Sse2(float* acc, const uint16_t* row, float w, int n) {
+    const __m128 vw = _mm_set1_ps(w);
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i v16 = _mm_loadu_si128((const __m128i*)(row + i));
+        __m128i parts[2] = {_mm_unpacklo_epi16(v16, zero), _mm_unpackhi_epi16(v16, zero)};
+        for (int k = 0; k < 2; k++) {
+            __m128 v = _mm_cvtepi32_ps(parts[k]);
+            _mm_storeu_ps(acc + i + 4*k, _mm_add_ps(_mm_loadu_ps(acc + i + 4*k), _mm_mul_ps(v, vw)));
+        }
+    }
+    return i;
+}
+#endif
+
+// addWeightedRow for 16 bit brightness
+static void addWeightedRow16(float* acc, const uint16_t* row, float w, int n) {
+    int i = 0;
+#ifdef LITHO_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        i = addWeightedRow16Avx2(acc, row, w, n);
+    } else
+#endif
+    {
+#ifdef LITHO_SSE2
+        i = addWeightedRow16Sse2(acc, row, w, n);
+#endif
+    }
+    for (; i < n; i++) {
+        acc[i] += w*row[i];
+    }
+}
@@ -0,0 +1,434 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+// Edge collapse simplification of an Obj using quadric error metrics (Garland & Heckbert '97).
+// Every vertex carries the sum of the squared distances to the planes of the faces it started out
+// touching, and the edge that's cheapest to collapse by that measure goes first, until the mesh is
+// down to the face budget or the next collapse would cost more than the error limit.
+// Collapses that would break the mesh are skipped: the edge has to be shared by exactly two faces,
+// its ends can't share any neighbours besides the two across those faces (that would pinch the
+// surface), and no face may flip over or turn far enough to fold.
+// Only the first n_free vertices move, and of those, any vertex on a face that uses a later vertex
+// stays put too. For a lithophane that keeps the frame and the edge of the image where it meets the frame.
+// Expects geometry.c to be included first.
+
+typedef struct {
+    double q[10]; // upper half of the symmetric 4x4 matrix: xx xy xz xw yy yz yw zz zw ww
+} Quadric;
+
+typedef struct {
+    float cost;
+    int a; // the vertex that stays
+    int b; // the vertex that's removed
+    uint16_t stamp_a;
+    uint16_t stamp_b;
+} Collapse;
+
+typedef struct {
+    Obj* obj;
+    Quadric* quadrics;
+    char* fixed;
+    char* vert_dead;
+    char* face_dead;
+    uint16_t* stamps; // bumped whenever a vertex moves or goes away, so stale heap entries can be spotted
+    int* ref_start; // faces around each vertex are refs[ref_start[v]] to refs[ref_start[v] + ref_count[v]]
+    int* ref_count;
+    int* refs;
+    size_t n_refs;
+    size_t max_refs;
+    int* marks;
+    int mark;
+    Collapse* heap;
+    size_t heap_len;
+    size_t heap_cap;
+    int n_live_faces;
+} Simplifier;
+
+static Quadric planeQuadric(Pos p1, Pos p2, Pos p3) {
+    double ux = p2.x - p1.x, uy = p2.y - p1.y, uz = p2.z - p1.z;
+    double vx = p3.x - p1.x, vy = p3.y - p1.y, vz = p3.z - p1.z;
+    double a = uy*vz - uz*vy, b = uz*vx - ux*vz, c = ux*vy - uy*vx;
+    double len = sqrt(a*a + b*b + c*c);
+    Quadric q = {0};
+    if (len == 0) {
+        return q;
+    }
+    a /= len; b /= len; c /= len;
+    double d = -(a*p1.x + b*p1.y + c*p1.z);
+    double plane[4] = {a, b, c, d};
+    int k = 0;
+    for (int i = 0; i < 4; i++) {
+        for (int j = i; j < 4; j++) {
+            q.q[k++] = plane[i]*plane[j];
+        }
+    }
+    return q;
+}
+static inline void addQuadric(Quadric* dst, const Quadric* src) {
+    for (int i = 0; i < 10; i++) {
+        dst->q[i] += src->q[i];
+    }
+}
+static inline double quadricError(const Quadric* q, double x, double y, double z) {
+    const double* m = q->q;
+    return m[0]*x*x + 2*m[1]*x*y + 2*m[2]*x*z + 2*m[3]*x
+         + m[4]*y*y + 2*m[5]*y*z + 2*m[6]*y
+         + m[7]*z*z + 2*m[8]*z
+         + m[9];
+}
+static int quadricMinimum(const Quadric* q, double out[3]) { // point of least error, 0 if there isn't a single one
+    const double* m = q->q;
+    double a00 = m[0], a01 = m[1], a02 = m[2], a11 = m[4], a12 = m[5], a22 = m[7];
+    double c00 = a11*a22 - a12*a12, c01 = a02*a12 - a01*a22, c02 = a01*a12 - a02*a11;
+    double det = a00*c00 + a01*c01 + a02*c02;
+    if (fabs(det) < 1e-12) {
+        return 0;
+    }
+    double c11 = a00*a22 - a02*a02, c12 = a01*a02 - a00*a12, c22 = a00*a11 - a01*a01;
+    double bx = -m[3], by = -m[6], bz = -m[8];
+    out[0] = (c00*bx + c01*by + c02*bz)/det;
+    out[1] = (c01*bx + c11*by + c12*bz)/det;
+    out[2] = (c02*bx + c12*by + c22*bz)/det;
+    return 1;
+}
+
+// where collapsing edge a-b should put the vertex, and what it costs. a and b may be swapped so that
+// a fixed vertex is the one that stays. returns 0 if neither end can move.
+static int planCollapse(const Simplifier* s, int a, int b, Collapse* c, Pos* target) {
+    if (s->fixed[a] && s->fixed[b]) {
+        return 0;
+    }
+    if (s->fixed[b]) {
+        int t = a; a = b; b = t;
+    }
+    Quadric q = s->quadrics[a];
+    addQuadric(&q, &s->quadrics[b]);
+    Pos pa = s->obj->verts[a], pb = s->obj->verts[b];
+    Pos best = pa;
+    double best_cost = quadricError(&q, pa.x, pa.y, pa.z);
+    if (!s->fixed[a]) {
+        Pos mid = {(pa.x + pb.x)/2, (pa.y + pb.y)/2, (pa.z + pb.z)/2};
+        Pos options[3] = {pb, mid, mid};
+        double opt[3];
+        if (quadricMinimum(&q, opt)) { // only trusted near the edge, nearly flat areas can put it anywhere
+            double dx = opt[0] - mid.x, dy = opt[1] - mid.y, dz = opt[2] - mid.z;
+            double ex = pb.x - pa.x, ey = pb.y - pa.y, ez = pb.z - pa.z;
+            if (dx*dx + dy*dy + dz*dz <= ex*ex + ey*ey + ez*ez) {
+                options[2] = (Pos){opt[0], opt[1], opt[2]};
+            }
+        }
+        for (int i = 0; i < 3; i++) {
+            double cost = quadricError(&q, options[i].x, options[i].y, options[i].z);
+            if (cost < best_cost) {
+                best_cost = cost;
+                best = options[i];
+            }
+        }
+    }
+    *c = (Collapse){.cost = best_cost > 0 ? best_cost : 0, .a = a, .b = b, .stamp_a = s->stamps[a], .stamp_b = s->stamps[b]};
+    *target = best;
+    return 1;
+}
+
+static void heapPush(Simplifier* s, Collapse c) {
+    if (s->heap_len == s->heap_cap) {
+        s->heap_cap *= 2;
+        s->heap = (Collapse*)realloc(s->heap, sizeof(Collapse)*s->heap_cap);
+    }
+    size_t i = s->heap_len++;
+    while (i > 0 && s->heap[(i - 1)/2].cost > c.cost) {
+        s->heap[i] = s->heap[(i - 1)/2];
+        i = (i - 1)/2;
+    }
+    s->heap[i] = c;
+}
+static Collapse heapPop(Simplifier* s) {
+    Collapse top = s->heap[0];
+    Collapse last = s->heap[--s->heap_len];
+    size_t i = 0;
+    while (1) {
+        size_t child = 2*i + 1;
+        if (child >= s->heap_len) {
+            break;
+        }
+        if (child + 1 < s->heap_len && s->heap[child + 1].cost < s->heap[child].cost) {
+            child++;
+        }
+        if (s->heap[child].cost >= last.cost) {
+            break;
+        }
+        s->heap[i] = s->heap[child];
+        i = child;
+    }
+    if (s->heap_len > 0) {
+        s->heap[i] = last;
+    }
+    return top;
+}
+static void pushEdge(Simplifier* s, int a, int b) {
+    Collapse c;
+    Pos target;
+    if (planCollapse(s, a, b, &c, &target)) {
+        heapPush(s, c);
+    }
+}
+
+static void buildRefs(Simplifier* s) { // lists the live faces around every vertex, packed at the start of refs
+    const Obj* obj = s->obj;
+    memset(s->ref_count, 0, sizeof(int)*obj->n_verts);
+    for (int f = 0; f < obj->n_faces; f++) {
+        if (!s->face_dead[f]) {
+            s->ref_count[obj->faces[f].v1]++;
+            s->ref_count[obj->faces[f].v2]++;
+            s->ref_count[obj->faces[f].v3]++;
+        }
+    }
+    size_t start = 0;
+    for (int v = 0; v < obj->n_verts; v++) {
+        s->ref_start[v] = start;
+        start += s->ref_count[v];
+        s->ref_count[v] = 0;
+    }
+    for (int f = 0; f < obj->n_faces; f++) {
+        if (!s->face_dead[f]) {
+            Face face = obj->faces[f];
+            s->refs[s->ref_start[face.v1] + s->ref_count[face.v1]++] = f;
+            s->refs[s->ref_start[face.v2] + s->ref_count[face.v2]++] = f;
+            s->refs[s->ref_start[face.v3] + s->ref_count[face.v3]++] = f;
+        }
+    }
+    s->n_refs = start;
+}
+
+static inline int faceHas(Face f, int v) {
+    return f.v1 == v || f.v2 == v || f.v3 == v;
+}
+static inline Pos faceNormal(Pos p1, Pos p2, Pos p3) { // not normalized
+    float ux = p2.x - p1.x, uy = p2.y - p1.y, uz = p2.z - p1.z;
+    float vx = p3.x - p1.x, vy = p3.y - p1.y, vz = p3.z - p1.z;
+    return (Pos){uy*vz - uz*vy, uz*vx - ux*vz, ux*vy - uy*vx};
+}
+
+// checks that moving a and b to target and merging them keeps the mesh manifold and doesn't flip any faces
+static int canCollapse(Simplifier* s, int a, int b, Pos target) {
+    const Obj* obj = s->obj;
+    int shared = 0;
+    int opposite[2] = {-1, -1};
+    for (int i = 0; i < s->ref_count[a]; i++) {
+        int fi = s->refs[s->ref_start[a] + i];
+        if (s->face_dead[fi]) {
+            continue;
+        }
+        Face f = obj->faces[fi];
+        if (faceHas(f, b)) {
+            if (shared == 2) {
+                return 0;
+            }
+            opposite[shared++] = f.v1 != a && f.v1 != b ? f.v1 : f.v2 != a && f.v2 != b ? f.v2 : f.v3;
+        }
+    }
+    if (shared != 2 || opposite[0] == opposite[1]) {
+        return 0;
+    }
+
+    s->mark++;
+    for (int i = 0; i < s->ref_count[a]; i++) {
+        int fi = s->refs[s->ref_start[a] + i];
+        if (s->face_dead[fi]) {
+            continue;
+        }
+        Face f = obj->faces[fi];
+        s->marks[f.v1] = s->marks[f.v2] = s->marks[f.v3] = s->mark;
+    }
+    for (int i = 0; i < s->ref_count[b]; i++) {
+        int fi = s->refs[s->ref_start[b] + i];
+        if (s->face_dead[fi]) {
+            continue;
+        }
+        Face f = obj->faces[fi];
+        int vs[3] = {f.v1, f.v2, f.v3};
+        for (int k = 0; k < 3; k++) {
+            int v = vs[k];
+            if (v != a && v != b && v != opposite[0] && v != opposite[1] && s->marks[v] == s->mark) {
+                return 0;
+            }
+        }
+    }
+
+    int ends[2] = {a, b};
+    for (int e = 0; e < 2; e++) {
+        int v = ends[e];
+        for (int i = 0; i < s->ref_count[v]; i++) {
+            int fi = s->refs[s->ref_start[v] + i];
+            if (s->face_dead[fi]) {
+                continue;
+            }
+            Face f = obj->faces[fi];
+            if (faceHas(f, a) && faceHas(f, b)) {
+                continue;
+            }
+            Pos p[3] = {obj->verts[f.v1], obj->verts[f.v2], obj->verts[f.v3]};
+            Pos before = faceNormal(p[0], p[1], p[2]);
+            if (f.v1 == v) p[0] = target;
+            if (f.v2 == v) p[1] = target;
+            if (f.v3 == v) p[2] = target;
+            Pos after = faceNormal(p[0], p[1], p[2]);
+            double dot = (double)before.x*after.x + (double)before.y*after.y + (double)before.z*after.z;
+            double len_before = sqrt((double)before.x*before.x + (double)before.y*before.y + (double)before.z*before.z);
+            double len_after = sqrt((double)after.x*after.x + (double)after.y*after.y + (double)after.z*after.z);
+            if (len_after == 0 || dot < 0.25*len_before*len_after) { // flipped, or turned far enough to risk a fold
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+static void collapseEdge(Simplifier* s, int a, int b, Pos target) {
+    Obj* obj = s->obj;
+    if (s->n_refs + s->ref_count[a] + s->ref_count[b] > s->max_refs) {
+        buildRefs(s);
+    }
+    int n_a = s->ref_count[a], n_b = s->ref_count[b];
+    int* merged = s->refs + s->n_refs;
+    int n = 0;
+    for (int i = 0; i < n_a; i++) {
+        int f = s->refs[s->ref_start[a] + i];
+        if (s->face_dead[f]) {
+            continue;
+        }
+        if (faceHas(obj->faces[f], b)) {
+            s->face_dead[f] = 1;
+            s->n_live_faces--;
+        } else {
+            merged[n++] = f;
+        }
+    }
+    for (int i = 0; i < n_b; i++) {
+        int f = s->refs[s->ref_start[b] + i];
+        if (s->face_dead[f]) {
+            continue;
+        }
+        Face* face = &obj->faces[f];
+        if (face->v1 == b) face->v1 = a;
+        if (face->v2 == b) face->v2 = a;
+        if (face->v3 == b) face->v3 = a;
+        merged[n++] = f;
+    }
+    s->ref_start[a] = s->n_refs;
+    s->ref_count[a] = n;
+    s->ref_count[b] = 0;
+    s->n_refs += n;
+
+    addQuadric(&s->quadrics[a], &s->quadrics[b]);
+    obj->verts[a] = target;
+    s->vert_dead[b] = 1;
+    s->stamps[a]++;
+    s->stamps[b]++;
+
+    s->mark++;
+    s->marks[a] = s->mark;
+    for (int i = 0; i < n; i++) {
+        Face f = obj->faces[merged[i]];
+        int vs[3] = {f.v1, f.v2, f.v3};
+        for (int k = 0; k < 3; k++) {
+            if (s->marks[vs[k]] != s->mark) {
+                s->marks[vs[k]] = s->mark;
+                pushEdge(s, a, vs[k]);
+            }
+        }
+    }
+}
+
+// collapses edges until obj has at most max_faces faces (0 for no limit), or the cheapest collapse
+// left would put the surface further than max_error from the original (0 for no limit).
+// the error is measured as the root of the summed squared distances to the original face planes
+// around the vertex, so it never underestimates the distance to any one of them.
+// obj->first_vert must be 0. vertices and faces that are kept stay in the same order.
+static void simplifyObj(Obj* obj, int n_free, int max_faces, float max_error) {
+    const int n_verts = obj->n_verts, n_faces = obj->n_faces;
+    double max_cost = max_error > 0 ? (double)max_error*max_error : INFINITY;
+    Simplifier s = {.obj = obj, .n_live_faces = n_faces, .mark = 0};
+    s.quadrics = (Quadric*)calloc(n_verts, sizeof(Quadric));
+    s.fixed = (char*)calloc(n_verts, 1);
+    s.vert_dead = (char*)calloc(n_verts, 1);
+    s.face_dead = (char*)calloc(n_faces, 1);
+    s.stamps = (uint16_t*)calloc(n_verts, sizeof(uint16_t));
+    s.ref_start = (int*)malloc(sizeof(int)*n_verts);
+    s.ref_count = (int*)malloc(sizeof(int)*n_verts);
+    s.max_refs = (size_t)n_faces*3*2; // room to append merged lists before they need packing again
+    s.refs = (int*)malloc(sizeof(int)*s.max_refs);
+    s.marks = (int*)calloc(n_verts, sizeof(int));
+    s.heap_cap = (size_t)n_faces*3/2 + 16;
+    s.heap = (Collapse*)malloc(sizeof(Collapse)*s.heap_cap);
+    s.heap_len = 0;
+
+    for (int f = 0; f < n_faces; f++) { // 0-based while we work
+        Face* face = &obj->faces[f];
+        face->v1--; face->v2--; face->v3--;
+        Quadric q = planeQuadric(obj->verts[face->v1], obj->verts[face->v2], obj->verts[face->v3]);
+        addQuadric(&s.quadrics[face->v1], &q);
+        addQuadric(&s.quadrics[face->v2], &q);
+        addQuadric(&s.quadrics[face->v3], &q);
+        if (face->v1 >= n_free || face->v2 >= n_free || face->v3 >= n_free) {
+            s.fixed[face->v1] = s.fixed[face->v2] = s.fixed[face->v3] = 1;
+        }
+    }
+    for (int v = n_free; v < n_verts; v++) {
+        s.fixed[v] = 1;
+    }
+    buildRefs(&s);
+    for (int f = 0; f < n_faces; f++) { // each edge between two faces shows up once in each direction
+        Face face = obj->faces[f];
+        if (face.v1 < face.v2) pushEdge(&s, face.v1, face.v2);
+        if (face.v2 < face.v3) pushEdge(&s, face.v2, face.v3);
+        if (face.v3 < face.v1) pushEdge(&s, face.v3, face.v1);
+    }
+
+    while (s.heap_len > 0 && (max_faces <= 0 || s.n_live_faces > max_faces)) {
+        Collapse c = heapPop(&s);
+        if (s.vert_dead[c.a] || s.vert_dead[c.b] || s.stamps[c.a] != c.stamp_a || s.stamps[c.b] != c.stamp_b) {
+            continue; // one of the ends changed since this was queued
+        }
+        Pos target;
+        planCollapse(&s, c.a, c.b, &c, &target);
+        if (c.cost > max_cost) {
+            break;
+        }
+        if (canCollapse(&s, c.a, c.b, target)) {
+            collapseEdge(&s, c.a, c.b, target);
+        }
+    }
+
+    int* new_index = s.marks; // reused
+    int n = 0;
+    for (int v = 0; v < n_verts; v++) {
+        if (!s.vert_dead[v]) {
+            obj->verts[n] = obj->verts[v];
+            new_index[v] = ++n; // back to 1-based
+        }
+    }
+    obj->n_verts = n;
+    n = 0;
+    for (int f = 0; f < n_faces; f++) {
+        if (!s.face_dead[f]) {
+            Face face = obj->faces[f];
+            obj->faces[n++] = (Face){.v1 = new_index[face.v1], .v2 = new_index[face.v2], .v3 = new_index[face.v3]};
+        }
+    }
+    obj->n_faces = n;
+
+    free(s.quadrics);
+    free(s.fixed);
+    free(s.vert_dead);
+    free(s.face_dead);
+    free(s.stamps);
+    free(s.ref_start);
+    free(s.ref_count);
+    free(s.refs);
+    free(s.marks);
+    free(s.heap);
+}
@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+// --sweep: one image made with several values of some options, like a calibration print at
+// different thicknesses. Each --sweep key=v1,v2,... gives values for one option (any mesh option
+// that takes a value, or the format, without its dashes), and every combination of the values is
+// made, up to MAX_SWEEP_VARIANTS of them. The image is decoded once, and its brightness sampled
+// and measured once for each pixels_per_vertex and filter in the sweep. Then a pool of workers,
+// one per thread, each take the next combination and build and save it on their own, keeping
+// their output buffer from one to the next.
+// Outputs are named after the output file and the values, output_min_thickness-2_bright_scale-0.05.obj
+// expects cli.c to be included first
+
+#define MAX_SWEEP_VARIANTS 10000 // most combinations one run will make
+
+typedef struct {
+    Settings settings;
+    char* name; // the key-value part of the output name
+} SweepVariant;
+
+typedef struct {
+    SweepVariant* variants;
+    int n;
+    const Settings* base;
+} SweepPlan;
+
+static void freeSweepPlan(SweepPlan* plan) {
+    for (int i = 0; i < plan->n; i++) {
+        if (plan->variants[i].settings.opts.curve_points != plan->base->opts.curve_points) {
+            free(plan->variants[i].settings.opts.curve_points);
+        }
+        free(plan->variants[i].name);
+    }
+    free(plan->variants);
+    *plan = (SweepPlan){0};
+}
+
+static int sweepValueCount(const char* sweep) {
+    int n = 1;
+    for (const char* p = strchr(sweep, '='); *p; p++) {
+        n += *p == ',';
+    }
+    return n;
+}
+static const char* sweepValue(const char* sweep, int j, int* len) { // the j-th value of key=v1,v2,...
+    const char* value = strchr(sweep, '=') + 1;
+    for (; j > 0; j--) {
+        value = strchr(value, ',') + 1;
+    }
+    const char* comma = strchr(value, ',');
+    *len = comma ? (int)(comma - value) : (int)strlen(value);
+    return value;
+}
+
+// the settings for every combination of base's --sweep values. on a bad sweep, returns 0 with a message in error
+static int planSweep(const Settings* base, SweepPlan* plan, char* error, size_t error_size) {
+    *plan = (SweepPlan){.base = base};
+    int n = 1;
+    for (int k = 0; k < base->n_sweeps; k++) {
+        int count = sweepValueCount(base->sweeps[k]);
+        if (n > MAX_SWEEP_VARIANTS/count) {
+            snprintf(error, error_size, "--sweep would make more than %d meshes", MAX_SWEEP_VARIANTS);
+            return 0;
+        }
+        n *= count;
+    }
+    plan->variants = (SweepVariant*)calloc(n, sizeof(SweepVariant));
+    for (int i = 0; i < n; i++) {
+        int picks[MAX_SWEEPS];
+        for (int k = base->n_sweeps - 1, index = i; k >= 0; k--) { // the last sweep changes fastest
+            picks[k] = index % sweepValueCount(base->sweeps[k]);
+            index /= sweepValueCount(base->sweeps[k]);
+        }
+        SweepVariant* v = &plan->variants[i];
+        v->settings = *base;
+        v->settings.n_sweeps = 0;
+        v->name = (char*)calloc(1, 1);
+        plan->n++;
+        for (int k = 0; k < base->n_sweeps; k++) {
+            const char* sweep = base->sweeps[k];
+            int key_len = strchr(sweep, '=') - sweep;
+            int value_len;
+            const char* value = sweepValue(sweep, picks[k], &value_len);
+            char arg[512];
+            snprintf(arg, sizeof(arg), "--%.*s=%.*s", key_len, sweep, value_len, value);
+            char* args[] = {arg};
+            if (!parseOptions(1, args, 0, &v->settings, error, error_size) || !checkSettings(&v->settings, error, error_size)) {
+                freeSweepPlan(plan);
+                return 0;
+            }
+            // only the mesh options and the format are made per variant. the rest is shared by the whole
+            // run (loading, threads, output name, cache, timings), or means nothing here (queue)
+            const Settings* s = &v->settings;
+            if (memcmp(&s->load, &base->load, sizeof(LithoLoadOptions)) != 0 || s->opts.threads != base->opts.threads
+                || s->output_file != base->output_file || s->queue != base->queue || s->cache.dir != base->cache.dir
+                || s->cache.max_bytes != base->cache.max_bytes || s->timings != base->timings || s->n_sweeps != 0) {
+                snprintf(error, error_size, "Can't sweep %.*s", key_len, sweep);
+                freeSweepPlan(plan);
+                return 0;
+            }
+            size_t name_len = strlen(v->name);
+            v->name = (char*)realloc(v->name, name_len + key_len + value_len + 3);
+            sprintf(v->name + name_len, "_%.*s-%.*s", key_len, sweep, value_len, value);
+            for (char* p = v->name + name_len; *p; p++) { // a curve file's directory would end up in the path
+                if (*p == '/' || *p == '\\') {
+                    *p = '-';
+                }
+            }
+        }
+    }
+    return 1;
+}
+
+typedef struct {
+    int pixels_per_vertex;
+    LithoFilter filter;
+    LithoGrid grid;
+} SweepSample;
+
+typedef struct {
+    const SweepPlan* plan;
+    const SweepSample* samples;
+    int* sample_of; // which sample each variant uses
+    char** outputs;
+    int threads; // how many each variant gets
+    int argc; // for the obj header
+    char** argv;
+    uint64_t next;
+    uint64_t done;
+    uint64_t failed;
+} Sweep;
+
+static void sweepWorker(void* ctx, int worker) { // takes variants until there are none left
+    Sweep* sweep = (Sweep*)ctx;
+    (void)worker; // workers all take from the same counter, which one this is doesn't matter
+    OutBuf out = outBufInit(flushToFile, NULL);
+    uint64_t i;
+    while ((i = atomicAdd(&sweep->next, 1)) < (uint64_t)sweep->plan->n) {
+        const Settings* s = &sweep->plan->variants[i].settings;
+        LithoOptions opts = s->opts;
+        opts.threads = sweep->threads;
+        Lithophane litho = sharedGridLithophane(&sweep->samples[sweep->sample_of[i]].grid, opts);
+        MeshSource mesh = lithophaneSource(&litho);
+        int saved = saveMeshBuffered(mesh, s->format, sweep->outputs[i], sweep->argc, sweep->argv, opts.threads, &out);
+        if (!saved) {
+            atomicAdd(&sweep->failed, 1);
+        }
+        uint64_t done = atomicAdd(&sweep->done, 1) + 1;
+        if (saved) {
+            printf("[%llu/%d] %s (%d faces)\n", (unsigned long long)done, sweep->plan->n, sweep->outputs[i], mesh.n_faces);
+        } else {
+            printf("[%llu/%d] failed to write: %s\n", (unsigned long long)done, sweep->plan->n, sweep->outputs[i]);
+        }
+        fflush(stdout);
+        freeSharedGridLithophane(&litho);
+    }
+    free(out.buf);
+}
+
+// where variant goes: output with the variant's name put before the extension, which follows its format
+static char* sweepOutputPath(const char* output, const SweepVariant* variant) {
+    const char* ext = variant->settings.format == LITHO_FORMAT_STL ? "stl" : variant->settings.format == LITHO_FORMAT_3MF ? "3mf" : "obj";
+    const char* name = output;
+    for (const char* p = output; *p; p++) {
+        if (*p == '/' || *p == '\\') {
+            name = p + 1;
+        }
+    }
+    const char* dot = strrchr(name, '.');
+    size_t stem_len = dot && dot != name ? (size_t)(dot - output) : strlen(output);
+    size_t len = stem_len + strlen(variant->name) + strlen(ext) + 2;
+    char* path = (char*)malloc(len);
+    snprintf(path, len, "%.*s%s.%s", (int)stem_len, output, variant->name, ext);
+    return path;
+}
+
+// makes every variant in plan from img, which it takes ownership of. output is the name they're based on.
+// returns how many failed
+static int runSweep(Image img, const SweepPlan* plan, const char* output, int argc, char* argv[]) {
+    int n_threads = resolveThreads(plan->base->opts.threads);
+    SweepSample* samples = (SweepSample*)malloc(sizeof(SweepSample)*plan->n);
+    int n_samples = 0;
+    int* sample_of = (int*)malloc(sizeof(int)*plan->n);
+    char** outputs = (char**)malloc(sizeof(char*)*plan->n);
+    for (int i = 0; i < plan->n; i++) {
+        LithoOptions opts = plan->variants[i].settings.opts;
+        int s = 0;
+        while (s < n_samples && (samples[s].pixels_per_vertex != opts.pixels_per_vertex || samples[s].filter != opts.filter)) {
+            s++;
+        }
+        if (s == n_samples) {
+            opts.threads = n_threads;
+            samples[n_samples++] = (SweepSample){.pixels_per_vertex = opts.pixels_per_vertex, .filter = opts.filter, .grid = sampleLithoGrid(img, opts, NULL)};
+        }
+        sample_of[i] = s;
+        outputs[i] = sweepOutputPath(output, &plan->variants[i]);
+    }
+    freeImage(&img);
+
+    int n_workers = n_threads < plan->n ? n_threads : plan->n;
+    n_workers = n_workers > 0 ? n_workers : 1;
+    Sweep sweep = {
+        .plan = plan, .samples = samples, .sample_of = sample_of, .outputs = outputs,
+        .threads = n_threads/n_workers, .argc = argc, .argv = argv,
+    };
+    parallelFor(n_workers, n_workers, sweepWorker, &sweep);
+
+    for (int s = 0; s < n_samples; s++) {
+        freeLithoGrid(&samples[s].grid);
+    }
+    for (int i = 0; i < plan->n; i++) {
+        free(outputs[i]);
+    }
+    free(samples);
+    free(sample_of);
+    free(outputs);
+    return sweep.failed;
+}
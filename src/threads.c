@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+// Just enough threading for splitting loops over cores. On windows everything runs on the calling thread.
+
+static int cpuCount() {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? info.dwNumberOfProcessors : 1;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+#endif
+}
+static int resolveThreads(int threads) { // 0 means one per core
+    return threads > 0 ? threads : cpuCount();
+}
+
+static inline uint64_t atomicAdd(uint64_t* target, uint64_t v) { // for tasks adding into shared totals. returns the old value
+#ifdef __GNUC__
+    return __atomic_fetch_add(target, v, __ATOMIC_RELAXED);
+#else
+    uint64_t old = *target; // compilers without the gnu builtins only come up on windows, where tasks run one at a time
+    *target += v;
+    return old;
+#endif
+}
+
+typedef void (*TaskFn)(void* ctx, int task);
+
+typedef struct {
+    TaskFn fn;
+    void* ctx;
+    int n_tasks;
+    int next_task;
+#ifndef _WIN32
+    pthread_mutex_t lock;
+#endif
+} ParallelJob;
+
+#ifndef _WIN32
+static void* parallelWorker(void* arg) {
+    ParallelJob* job = (ParallelJob*)arg;
+    while (1) {
+        pthread_mutex_lock(&job->lock);
+        int task = job->next_task++;
+        pthread_mutex_unlock(&job->lock);
+        if (task >= job->n_tasks) {
+            break;
+        }
+        job->fn(job->ctx, task);
+    }
+    return NULL;
+}
+#endif
+
+// calls fn(ctx, task) for every task in [0, n_tasks) spread over up to n_threads threads, and returns when all are done.
+// tasks are handed out in order, but may finish in any order.
+static void parallelFor(int n_tasks, int n_threads, TaskFn fn, void* ctx) {
+    if (n_threads > n_tasks) {
+        n_threads = n_tasks;
+    }
+#ifndef _WIN32
+    if (n_threads > 1) {
+        ParallelJob job = {.fn = fn, .ctx = ctx, .n_tasks = n_tasks, .next_task = 0};
+        pthread_mutex_init(&job.lock, NULL);
+        pthread_t* threads = (pthread_t*)malloc(sizeof(pthread_t)*(n_threads - 1));
+        int started = 0;
+        for (int i = 0; i < n_threads - 1; i++) {
+            if (pthread_create(&threads[started], NULL, parallelWorker, &job) == 0) {
+                started++;
+            }
+        }
+        parallelWorker(&job);
+        for (int i = 0; i < started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        free(threads);
+        pthread_mutex_destroy(&job.lock);
+        return;
+    }
+#endif
+    for (int task = 0; task < n_tasks; task++) {
+        fn(ctx, task);
+    }
+}
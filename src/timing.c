@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+// --timings: where the time goes when making a mesh. Each phase is timed with a monotonic clock
+// where it's called, and adds its wall time, and how many bytes and vertices it went through, to
+// the Timings it's handed, which makeLithophane keeps in the LithoGrid for the phases after it. Only
+// main.c passes one, for a single image, so with it NULL (and always in the library, --batch,
+// --serve and --sweep) a phase costs one check of a NULL pointer.
+
+typedef enum {
+    PHASE_LOAD, // reading and decoding the file, cropping and shrinking
+    PHASE_SAMPLE, // brightness at each grid vertex, and the histogram for the statistics
+    PHASE_STATS, // mean, variance and max brightness from the histogram
+    PHASE_HEIGHTS, // the height table, and the grid heights from it
+    PHASE_GRID, // grid vertices and faces of a full Obj (with the frame too, without --max_error)
+    PHASE_FRAME,
+    PHASE_SIMPLIFY,
+    PHASE_TRANSFORM, // scale and flips of the stored vertices. streamed grid vertices get theirs as they're written
+    PHASE_WRITE,
+    N_PHASES,
+} Phase;
+static const char* const phase_names[N_PHASES] = {"load", "sample", "stats", "heights", "grid", "frame", "simplify", "transform", "write"};
+
+typedef enum {
+    TIMINGS_OFF,
+    TIMINGS_TABLE,
+    TIMINGS_JSON,
+} TimingsFormat;
+
+typedef struct {
+    double seconds;
+    uint64_t bytes; // pixels or mesh data made or read, or the output file for write
+    uint64_t verts;
+    int runs;
+} PhaseTime;
+
+typedef struct {
+    PhaseTime phases[N_PHASES];
+    double start;
+} Timings;
+
+static double monotonicSeconds() {
+#ifdef _WIN32
+    LARGE_INTEGER count, freq;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (double)count.QuadPart/freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+#endif
+}
+static inline double phaseStart(const Timings* timings) {
+    return timings ? monotonicSeconds() : 0;
+}
+static inline void phaseEnd(Timings* timings, Phase phase, double start, uint64_t bytes, uint64_t verts) {
+    if (timings) {
+        PhaseTime* p = &timings->phases[phase];
+        p->seconds += monotonicSeconds() - start;
+        p->bytes += bytes;
+        p->verts += verts;
+        p->runs++;
+    }
+}
+
+// a table of the phases that ran, or the same as json. rates of phases that went through no bytes or vertices are left out
+static void printTimings(const Timings* t, TimingsFormat format, FILE* f) {
+    double total = monotonicSeconds() - t->start;
+    if (format == TIMINGS_JSON) {
+        fprintf(f, "{\"wall_seconds\": %.6f, \"phases\": [", total);
+    } else {
+        fprintf(f, "%-10s %10s %10s %12s\n", "phase", "ms", "MB/s", "Mverts/s");
+    }
+    int first = 1;
+    for (int i = 0; i < N_PHASES; i++) {
+        const PhaseTime* p = &t->phases[i];
+        if (p->runs == 0) {
+            continue;
+        }
+        double mb_per_s = p->bytes && p->seconds > 0 ? p->bytes/p->seconds/1e6 : 0;
+        double verts_per_s = p->verts && p->seconds > 0 ? p->verts/p->seconds : 0;
+        if (format == TIMINGS_JSON) {
+            fprintf(f, "%s\n  {\"name\": \"%s\", \"seconds\": %.6f, \"bytes\": %llu, \"vertices\": %llu, \"mb_per_s\": %.3f, \"vertices_per_s\": %.1f}",
+                    first ? "" : ",", phase_names[i], p->seconds, (unsigned long long)p->bytes, (unsigned long long)p->verts, mb_per_s, verts_per_s);
+        } else {
+            char mb[32] = "-", verts[32] = "-";
+            if (mb_per_s > 0) {
+                snprintf(mb, sizeof(mb), "%.1f", mb_per_s);
+            }
+            if (verts_per_s > 0) {
+                snprintf(verts, sizeof(verts), "%.2f", verts_per_s/1e6);
+            }
+            fprintf(f, "%-10s %10.2f %10s %12s\n", phase_names[i], p->seconds*1e3, mb, verts);
+        }
+        first = 0;
+    }
+    if (format == TIMINGS_JSON) {
+        fprintf(f, "\n]}\n");
+    } else {
+        fprintf(f, "%-10s %10.2f\n", "wall", total*1e3);
+    }
+}
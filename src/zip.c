@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+// Minimal streaming zip writer, used for the 3mf container. Expects stb_image_write (see img.c) and fmt.c.
+// Deflate reuses the fixed huffman compressor from stb_image_write, but the bit buffer is kept
+// between calls so an entry can be compressed one chunk at a time. Input is collected into
+// ZIP_BLOCK_SIZE chunks, each chunk becomes its own (non-final) deflate block, and back references
+// never reach outside the chunk being compressed. Chunking doesn't depend on how the caller splits
+// up its writes, so the same data always gives the same bytes.
+// Sizes aren't known until an entry is finished, so they go in a data descriptor after the
+// compressed data and the output never has to be seekable.
+
+#define ZIP_MAX_ENTRIES 8
+#define ZIP_DEFLATE_QUALITY 5
+#define ZIP_BLOCK_SIZE (1 << 22)
+
+typedef struct {
+    char name[64];
+    uint32_t crc;
+    uint64_t raw_size;
+    uint64_t comp_size;
+    uint64_t offset;
+    int zip64;
+} ZipEntry;
+
+typedef struct {
+    OutBuf* dst;
+    uint64_t offset; // bytes written to dst so far
+    ZipEntry entries[ZIP_MAX_ENTRIES];
+    int n_entries;
+    uint32_t crc_table[256];
+    unsigned char*** hash_table;
+    unsigned char* in; // uncompressed bytes waiting for a full block
+    size_t in_len;
+    unsigned char* out; // stb stretchy buffer holding compressed bytes that haven't been written yet
+    unsigned int bitbuf;
+    int bitcount;
+} ZipWriter;
+
+static void zipPut16(unsigned char* p, uint32_t v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+}
+static void zipPut32(unsigned char* p, uint32_t v) {
+    zipPut16(p, v & 0xffff);
+    zipPut16(p + 2, v >> 16);
+}
+static void zipPut64(unsigned char* p, uint64_t v) {
+    zipPut32(p, (uint32_t)v);
+    zipPut32(p + 4, (uint32_t)(v >> 32));
+}
+
+static void zipEmit(ZipWriter* zw, const void* data, size_t len) {
+    putBytes(zw->dst, data, len);
+    zw->offset += len;
+}
+
+static void zipFlushOut(ZipWriter* zw) {
+    if (zw->out && stbiw__sbn(zw->out) > 0) {
+        zipEmit(zw, zw->out, stbiw__sbn(zw->out));
+        zw->entries[zw->n_entries - 1].comp_size += stbiw__sbn(zw->out);
+        stbiw__sbn(zw->out) = 0;
+    }
+}
+
+static int zipOpen(ZipWriter* zw, OutBuf* dst) {
+    memset(zw, 0, sizeof(*zw));
+    zw->dst = dst;
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        }
+        zw->crc_table[i] = c;
+    }
+    zw->hash_table = (unsigned char***)calloc(stbiw__ZHASH, sizeof(unsigned char**));
+    zw->in = (unsigned char*)malloc(ZIP_BLOCK_SIZE);
+    return zw->hash_table != NULL && zw->in != NULL;
+}
+
+static void zipBeginEntry(ZipWriter* zw, const char* name, int zip64) { // zip64 should be set if the entry could reach 4GB
+    ZipEntry* e = &zw->entries[zw->n_entries++];
+    memset(e, 0, sizeof(*e));
+    snprintf(e->name, sizeof(e->name), "%s", name);
+    e->crc = 0xffffffffu;
+    e->offset = zw->offset;
+    e->zip64 = zip64;
+
+    int name_len = strlen(e->name);
+    unsigned char h[30 + 20];
+    zipPut32(h, 0x04034b50);
+    zipPut16(h + 4, zip64 ? 45 : 20);    // version needed to extract
+    zipPut16(h + 6, 0x0008);             // sizes and crc are in the data descriptor
+    zipPut16(h + 8, 8);                  // deflate
+    zipPut16(h + 10, 0);                 // mod time
+    zipPut16(h + 12, (0 << 9) | (1 << 5) | 1); // mod date: 1980-01-01, keeps the output reproducible
+    zipPut32(h + 14, 0);                 // crc
+    zipPut32(h + 18, zip64 ? 0xffffffffu : 0);
+    zipPut32(h + 22, zip64 ? 0xffffffffu : 0);
+    zipPut16(h + 26, name_len);
+    zipPut16(h + 28, zip64 ? 20 : 0);
+    zipEmit(zw, h, 30);
+    zipEmit(zw, e->name, name_len);
+    if (zip64) {
+        zipPut16(h, 0x0001); // zip64 extended information, sizes follow in the data descriptor
+        zipPut16(h + 2, 16);
+        zipPut64(h + 4, 0);
+        zipPut64(h + 12, 0);
+        zipEmit(zw, h, 20);
+    }
+}
+
+// compress one block of the current entry with fixed huffman codes.
+// mirrors stbi_zlib_compress, minus the zlib wrapper, the final bit and the padding.
+static void zipDeflateBlock(ZipWriter* zw, unsigned char* data, int data_len) {
+    static const unsigned short lengthc[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258, 259 };
+    static const unsigned char  lengtheb[]= { 0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,  4,  5,  5,  5,  5,  0 };
+    static const unsigned short distc[]   = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577, 32768 };
+    static const unsigned char  disteb[]  = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+    const int quality = ZIP_DEFLATE_QUALITY;
+    unsigned char*** hash_table = zw->hash_table;
+    unsigned char* out = zw->out;
+    unsigned int bitbuf = zw->bitbuf;
+    int bitcount = zw->bitcount;
+    int i, j;
+
+    for (i = 0; i < stbiw__ZHASH; ++i) {
+        if (hash_table[i]) stbiw__sbn(hash_table[i]) = 0;
+    }
+    stbiw__zlib_add(0,1);  // BFINAL = 0
+    stbiw__zlib_add(1,2);  // BTYPE = 1 -- fixed huffman
+
+    i = 0;
+    while (i < data_len-3) {
+        int h = stbiw__zhash(data+i)&(stbiw__ZHASH-1), best=3;
+        unsigned char *bestloc = 0;
+        unsigned char **hlist = hash_table[h];
+        int n = stbiw__sbcount(hlist);
+        for (j=0; j < n; ++j) {
+            if (hlist[j]-data > i-32768) {
+                int d = stbiw__zlib_countm(hlist[j], data+i, data_len-i);
+                if (d >= best) { best=d; bestloc=hlist[j]; }
+            }
+        }
+        if (hash_table[h] && stbiw__sbn(hash_table[h]) == 2*quality) {
+            STBIW_MEMMOVE(hash_table[h], hash_table[h]+quality, sizeof(hash_table[h][0])*quality);
+            stbiw__sbn(hash_table[h]) = quality;
+        }
+        stbiw__sbpush(hash_table[h],data+i);
+
+        if (bestloc) {
+            h = stbiw__zhash(data+i+1)&(stbiw__ZHASH-1);
+            hlist = hash_table[h];
+            n = stbiw__sbcount(hlist);
+            for (j=0; j < n; ++j) {
+                if (hlist[j]-data > i-32767) {
+                    int e2 = stbiw__zlib_countm(hlist[j], data+i+1, data_len-i-1);
+                    if (e2 > best) {
+                        bestloc = NULL;
+                        break;
+                    }
+                }
+            }
+        }
+
+        if (bestloc) {
+            int d = (int) (data+i - bestloc);
+            for (j=0; best > lengthc[j+1]-1; ++j);
+            stbiw__zlib_huff(j+257);
+            if (lengtheb[j]) stbiw__zlib_add(best - lengthc[j], lengtheb[j]);
+            for (j=0; d > distc[j+1]-1; ++j);
+            stbiw__zlib_add(stbiw__zlib_bitrev(j,5),5);
+            if (disteb[j]) stbiw__zlib_add(d - distc[j], disteb[j]);
+            i += best;
+        } else {
+            stbiw__zlib_huffb(data[i]);
+            ++i;
+        }
+    }
+    for (;i < data_len; ++i) {
+        stbiw__zlib_huffb(data[i]);
+    }
+    stbiw__zlib_huff(256); // end of block
+
+    zw->out = out;
+    zw->bitbuf = bitbuf;
+    zw->bitcount = bitcount;
+    zipFlushOut(zw);
+}
+
+static void zipWrite(ZipWriter* zw, const void* src, size_t len) { // adds data to the current entry
+    const unsigned char* data = (const unsigned char*)src;
+    ZipEntry* e = &zw->entries[zw->n_entries - 1];
+    uint32_t crc = e->crc;
+    for (size_t k = 0; k < len; k++) {
+        crc = zw->crc_table[(crc ^ data[k]) & 0xff] ^ (crc >> 8);
+    }
+    e->crc = crc;
+    e->raw_size += len;
+
+    while (len > 0) {
+        size_t n = ZIP_BLOCK_SIZE - zw->in_len < len ? ZIP_BLOCK_SIZE - zw->in_len : len;
+        memcpy(zw->in + zw->in_len, data, n);
+        zw->in_len += n;
+        data += n;
+        len -= n;
+        if (zw->in_len == ZIP_BLOCK_SIZE) {
+            zipDeflateBlock(zw, zw->in, zw->in_len);
+            zw->in_len = 0;
+        }
+    }
+}
+
+static void zipEndEntry(ZipWriter* zw) {
+    ZipEntry* e = &zw->entries[zw->n_entries - 1];
+    if (zw->in_len > 0) {
+        zipDeflateBlock(zw, zw->in, zw->in_len);
+        zw->in_len = 0;
+    }
+    unsigned char* out = zw->out;
+    unsigned int bitbuf = zw->bitbuf;
+    int bitcount = zw->bitcount;
+    stbiw__zlib_add(1,1);  // empty final block
+    stbiw__zlib_add(1,2);
+    stbiw__zlib_huff(256);
+    while (bitcount) {
+        stbiw__zlib_add(0,1);
+    }
+    zw->out = out;
+    zw->bitbuf = 0;
+    zw->bitcount = 0;
+    zipFlushOut(zw);
+    e->crc ^= 0xffffffffu;
+
+    unsigned char d[24];
+    zipPut32(d, 0x08074b50);
+    zipPut32(d + 4, e->crc);
+    if (e->zip64) {
+        zipPut64(d + 8, e->comp_size);
+        zipPut64(d + 16, e->raw_size);
+        zipEmit(zw, d, 24);
+    } else {
+        zipPut32(d + 8, (uint32_t)e->comp_size);
+        zipPut32(d + 12, (uint32_t)e->raw_size);
+        zipEmit(zw, d, 16);
+    }
+}
+
+static void zipClose(ZipWriter* zw) { // writes the central directory, doesn't flush dst
+    uint64_t cd_start = zw->offset;
+    int any_zip64 = 0;
+    for (int i = 0; i < zw->n_entries; i++) {
+        ZipEntry* e = &zw->entries[i];
+        int name_len = strlen(e->name);
+        unsigned char h[46 + 28];
+        zipPut32(h, 0x02014b50);
+        zipPut16(h + 4, e->zip64 ? 45 : 20); // version made by
+        zipPut16(h + 6, e->zip64 ? 45 : 20); // version needed to extract
+        zipPut16(h + 8, 0x0008);
+        zipPut16(h + 10, 8);
+        zipPut16(h + 12, 0);
+        zipPut16(h + 14, (0 << 9) | (1 << 5) | 1);
+        zipPut32(h + 16, e->crc);
+        zipPut32(h + 20, e->zip64 ? 0xffffffffu : (uint32_t)e->comp_size);
+        zipPut32(h + 24, e->zip64 ? 0xffffffffu : (uint32_t)e->raw_size);
+        zipPut16(h + 28, name_len);
+        zipPut16(h + 30, e->zip64 ? 28 : 0);
+        zipPut16(h + 32, 0);  // comment length
+        zipPut16(h + 34, 0);  // disk number
+        zipPut16(h + 36, 0);  // internal attributes
+        zipPut32(h + 38, 0);  // external attributes
+        zipPut32(h + 42, e->zip64 ? 0xffffffffu : (uint32_t)e->offset);
+        zipEmit(zw, h, 46);
+        zipEmit(zw, e->name, name_len);
+        if (e->zip64) {
+            any_zip64 = 1;
+            zipPut16(h, 0x0001);
+            zipPut16(h + 2, 24);
+            zipPut64(h + 4, e->raw_size);
+            zipPut64(h + 12, e->comp_size);
+            zipPut64(h + 20, e->offset);
+            zipEmit(zw, h, 28);
+        }
+    }
+    uint64_t cd_size = zw->offset - cd_start;
+    if (cd_start >= 0xffffffffu) {
+        any_zip64 = 1;
+    }
+    if (any_zip64) {
+        uint64_t eocd64 = zw->offset;
+        unsigned char r[56];
+        zipPut32(r, 0x06064b50);
+        zipPut64(r + 4, 56 - 12);
+        zipPut16(r + 12, 45);
+        zipPut16(r + 14, 45);
+        zipPut32(r + 16, 0);
+        zipPut32(r + 20, 0);
+        zipPut64(r + 24, zw->n_entries);
+        zipPut64(r + 32, zw->n_entries);
+        zipPut64(r + 40, cd_size);
+        zipPut64(r + 48, cd_start);
+        zipEmit(zw, r, 56);
+        zipPut32(r, 0x07064b50); // zip64 end of central directory locator
+        zipPut32(r + 4, 0);
+        zipPut64(r + 8, eocd64);
+        zipPut32(r + 16, 1);
+        zipEmit(zw, r, 20);
+    }
+    unsigned char r[22];
+    zipPut32(r, 0x06054b50);
+    zipPut16(r + 4, 0);
+    zipPut16(r + 6, 0);
+    zipPut16(r + 8, zw->n_entries);
+    zipPut16(r + 10, zw->n_entries);
+    zipPut32(r + 12, cd_size >= 0xffffffffu ? 0xffffffffu : (uint32_t)cd_size);
+    zipPut32(r + 16, any_zip64 ? 0xffffffffu : (uint32_t)cd_start);
+    zipPut16(r + 20, 0);
+    zipEmit(zw, r, 22);
+
+    for (int i = 0; i < stbiw__ZHASH; i++) {
+        (void) stbiw__sbfree(zw->hash_table[i]);
+    }
+    free(zw->hash_table);
+    free(zw->in);
+    (void) stbiw__sbfree(zw->out);
+    zw->hash_table = NULL;
+    zw->out = NULL;
+}
@@ -0,0 +1,319 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+// A client for litho --serve, standing in for a front-end. Given a socket, a request line and
+// optionally a file to upload, it sends one request and writes the mesh that comes back:
+//
+//   gcc -O2 test/serve_client.c -o litho-serve-client
+//   ./litho-serve-client /run/litho.sock "- --format stl" photo.jpg > photo.stl
+//
+// With --check it instead starts its own server from a litho binary, with one worker and a queue of
+// one, and runs requests against it: path and uploaded images, options and images that can't make
+// a mesh, an upload over the size limit, and a full queue. Each check is listed with ok or FAILED,
+// and the exit status is 1 if any failed. Not available on windows.
+//
+//   ./litho-serve-client --check ./litho
+
+#define SERVE_MAX_UPLOAD ((size_t)1 << 30) // the same as in src/serve.c
+
+typedef struct {
+    char status[256]; // the answer line, without its newline
+    unsigned char* body; // what came after it, the mesh file for an ok
+    size_t size;
+} Reply;
+
+static int connectTo(const char* socket_path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+static int sendAll(int fd, const void* data, size_t len) {
+    const char* p = (const char*)data;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+// everything the server sends until it closes the connection, split into the answer line and the rest
+static int readReply(int fd, Reply* reply) {
+    size_t cap = 1 << 16, len = 0;
+    unsigned char* data = (unsigned char*)malloc(cap);
+    for (;;) {
+        if (len == cap) {
+            cap *= 2;
+            data = (unsigned char*)realloc(data, cap);
+        }
+        ssize_t n = recv(fd, data + len, cap - len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        len += n;
+    }
+    unsigned char* newline = (unsigned char*)memchr(data, '\n', len);
+    if (!newline) {
+        free(data);
+        *reply = (Reply){0};
+        return 0;
+    }
+    size_t line_len = newline - data;
+    snprintf(reply->status, sizeof(reply->status), "%.*s", (int)line_len, (const char*)data);
+    reply->size = len - line_len - 1;
+    reply->body = (unsigned char*)malloc(reply->size > 0 ? reply->size : 1);
+    memcpy(reply->body, newline + 1, reply->size);
+    free(data);
+    return 1;
+}
+// one request: the line, then upload_size bytes of upload (or that many zeros if upload is NULL).
+// a server that answers before taking all of an upload may close early, so send errors aren't fatal
+static int request(const char* socket_path, const char* line, const unsigned char* upload, size_t upload_size, Reply* reply) {
+    int fd = connectTo(socket_path);
+    if (fd < 0) {
+        *reply = (Reply){0};
+        return 0;
+    }
+    int sent = sendAll(fd, line, strlen(line)) && sendAll(fd, "\n", 1);
+    if (upload) {
+        sent = sent && sendAll(fd, upload, upload_size);
+    } else if (upload_size > 0) {
+        size_t block = 1 << 20;
+        unsigned char* zeros = (unsigned char*)calloc(1, block);
+        for (size_t done = 0; sent && done < upload_size; done += block) {
+            sent = sendAll(fd, zeros, upload_size - done < block ? upload_size - done : block);
+        }
+        free(zeros);
+    }
+    shutdown(fd, SHUT_WR);
+    int got = readReply(fd, reply);
+    close(fd);
+    return got;
+}
+static void freeReply(Reply* reply) {
+    free(reply->body);
+    reply->body = NULL;
+}
+
+static unsigned char* readFile(const char* path, size_t* size) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        return NULL;
+    }
+    size_t cap = 1 << 16;
+    unsigned char* data = (unsigned char*)malloc(cap);
+    *size = 0;
+    size_t n;
+    while ((n = fread(data + *size, 1, cap - *size, f)) > 0) {
+        *size += n;
+        if (*size == cap) {
+            cap *= 2;
+            data = (unsigned char*)realloc(data, cap);
+        }
+    }
+    fclose(f);
+    return data;
+}
+
+// a width x height grey gradient as a binary pgm, in memory
+static unsigned char* makePgm(int width, int height, size_t* size) {
+    char header[64];
+    int header_len = snprintf(header, sizeof(header), "P5\n%d %d\n255\n", width, height);
+    *size = header_len + (size_t)width*height;
+    unsigned char* data = (unsigned char*)malloc(*size);
+    memcpy(data, header, header_len);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            data[header_len + (size_t)y*width + x] = (unsigned char)((x*255/(width - 1) + y*64/(height - 1)) % 256);
+        }
+    }
+    return data;
+}
+
+typedef struct {
+    const char* socket_path;
+    int failed;
+} Checks;
+
+static void report(Checks* checks, const char* name, int passed, const Reply* reply) {
+    printf("%-40s %s", name, passed ? "ok" : "FAILED");
+    if (!passed) {
+        printf(" (got \"%s\")", reply->status[0] ? reply->status : "no answer");
+        checks->failed++;
+    }
+    printf("\n");
+}
+// a request that should be answered "ok <vertices> <faces>" and a mesh. the mesh is kept in reply
+static void checkOk(Checks* checks, const char* name, const char* line, const unsigned char* upload, size_t upload_size, Reply* reply) {
+    int n_verts = 0, n_faces = 0;
+    int passed = request(checks->socket_path, line, upload, upload_size, reply)
+        && sscanf(reply->status, "ok %d %d", &n_verts, &n_faces) == 2 && n_verts > 0 && n_faces > 0 && reply->size > 0;
+    report(checks, name, passed, reply);
+}
+// a request that should be answered with an error starting with expected
+static void checkError(Checks* checks, const char* name, const char* line, const unsigned char* upload, size_t upload_size, const char* expected) {
+    Reply reply;
+    char prefix[256];
+    snprintf(prefix, sizeof(prefix), "error %s", expected);
+    int passed = request(checks->socket_path, line, upload, upload_size, &reply) && strncmp(reply.status, prefix, strlen(prefix)) == 0;
+    report(checks, name, passed, &reply);
+    freeReply(&reply);
+}
+
+static pid_t startServer(const char* litho, const char* socket_path) {
+    unlink(socket_path);
+    pid_t pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        char* argv[] = {(char*)litho, "--serve", (char*)socket_path, "--threads", "1", "--queue", "1", "--format", "stl", NULL};
+        execv(litho, argv);
+        _exit(127);
+    }
+    for (int i = 0; i < 100; i++) { // up to 5 seconds for it to start listening
+        Reply reply;
+        if (request(socket_path, "", NULL, 0, &reply)) { // an empty request, answered once the worker is done with it
+            freeReply(&reply);
+            return pid;
+        }
+        usleep(50000);
+    }
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+static int runChecks(const char* litho) {
+    char socket_path[64], image_path[64];
+    snprintf(socket_path, sizeof(socket_path), "/tmp/litho-serve-check-%d.sock", (int)getpid());
+    snprintf(image_path, sizeof(image_path), "/tmp/litho-serve-check-%d.pgm", (int)getpid());
+    size_t image_size;
+    unsigned char* image = makePgm(64, 48, &image_size);
+    FILE* f = fopen(image_path, "wb");
+    if (!f || fwrite(image, 1, image_size, f) != image_size || fclose(f) != 0) {
+        printf("couldn't write %s\n", image_path);
+        return 1;
+    }
+    pid_t pid = startServer(litho, socket_path);
+    if (pid < 0) {
+        printf("couldn't start %s --serve %s\n", litho, socket_path);
+        unlink(image_path);
+        return 1;
+    }
+
+    Checks checks = {.socket_path = socket_path, .failed = 0};
+    char line[256];
+    Reply by_path, by_upload;
+    snprintf(line, sizeof(line), "%s --pixels_per_vertex 1", image_path);
+    checkOk(&checks, "image path", line, NULL, 0, &by_path);
+    checkOk(&checks, "uploaded image", "- --pixels_per_vertex 1", image, image_size, &by_upload);
+    Reply same = {.status = "a different mesh than for the path"};
+    report(&checks, "same mesh for path and upload", by_path.size == by_upload.size && memcmp(by_path.body, by_upload.body, by_path.size) == 0, &same);
+    freeReply(&by_path);
+    freeReply(&by_upload);
+
+    checkError(&checks, "empty request line", "", NULL, 0, "");
+    checkError(&checks, "missing image", "/nonexistent/litho.png", NULL, 0, "");
+    checkError(&checks, "unknown option", "- --bogus", image, image_size, "");
+    checkError(&checks, "pixels_per_vertex 0", "- --pixels_per_vertex 0", image, image_size, "");
+    checkError(&checks, "decode_scale 0", "- --decode_scale 0", image, image_size, "");
+    checkError(&checks, "image too small for pixels_per_vertex", "- --pixels_per_vertex 40", image, image_size, "image too small");
+    checkError(&checks, "upload that isn't an image", "-", (const unsigned char*)"not an image", 12, "");
+    checkError(&checks, "upload over the limit", "-", NULL, SERVE_MAX_UPLOAD + 1, "upload over");
+
+    // one connection for the worker to wait on, one waiting in the queue, and the next is turned away
+    int held[2];
+    held[0] = connectTo(socket_path);
+    usleep(200000); // for the worker to take it off the queue
+    held[1] = connectTo(socket_path);
+    usleep(200000);
+    checkError(&checks, "full queue", "-", image, image_size, "busy");
+    for (int i = 0; i < 2; i++) { // finish them as empty requests, so the queue is empty again once they're answered
+        if (held[i] >= 0) {
+            Reply reply;
+            shutdown(held[i], SHUT_WR);
+            if (readReply(held[i], &reply)) {
+                freeReply(&reply);
+            }
+            close(held[i]);
+        }
+    }
+
+    Reply after;
+    checkOk(&checks, "still serving after all that", "- --pixels_per_vertex 2 --format obj", image, image_size, &after);
+    freeReply(&after);
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    unlink(socket_path);
+    unlink(image_path);
+    free(image);
+    printf("%d check%s failed\n", checks.failed, checks.failed == 1 ? "" : "s");
+    return checks.failed ? 1 : 0;
+}
+
+static void printClientUsage() {
+    printf("usage: litho-serve-client <socket> <request line> [file to upload] > mesh\n");
+    printf("       litho-serve-client --check <litho binary>\n");
+    printf("the answer line goes to stderr, and the exit status is 1 for an error answer\n");
+}
+
+int main(int argc, char* argv[]) {
+    if (argc == 3 && strcmp(argv[1], "--check") == 0) {
+        return runChecks(argv[2]);
+    }
+    if (argc < 3 || argc > 4) {
+        printClientUsage();
+        return 1;
+    }
+    unsigned char* upload = NULL;
+    size_t upload_size = 0;
+    if (argc == 4 && !(upload = readFile(argv[3], &upload_size))) {
+        printf("couldn't read %s\n", argv[3]);
+        return 1;
+    }
+    Reply reply;
+    if (!request(argv[1], argv[2], upload, upload_size, &reply)) {
+        fprintf(stderr, "no answer from %s\n", argv[1]);
+        free(upload);
+        return 1;
+    }
+    fprintf(stderr, "%s\n", reply.status);
+    fwrite(reply.body, 1, reply.size, stdout);
+    int ok = strncmp(reply.status, "ok ", 3) == 0;
+    freeReply(&reply);
+    free(upload);
+    return ok ? 0 : 1;
+}